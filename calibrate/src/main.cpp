@@ -7,25 +7,39 @@
 #include <span>
 #include <array>
 #include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <format>
 
 #include <opencv2/opencv.hpp>
 
+#include "frame_cache.h"
+#include "chunked_writer.h"
+#include "progress_reporter.h"
+#include "debug_output.h"
+
 using namespace std;
 
 // Function to find nearest cube index
+// Templated on the cube dimensions so the search loops can be fully unrolled
+template <size_t NX, size_t NY, size_t NZ>
 tuple<int, int, int> find_nearest_cube_index(const array<double, 3>& measured_rgb,
-	const array<array<array<array<double, 3>, 8>, 8>, 8>& cube)
+	const array<array<array<array<double, 3>, NZ>, NY>, NX>& cube)
 {
 	double min_distance = 1e9; // initialize with a large number
 	int best_x = 0, best_y = 0, best_z = 0;
 
-	for (int x = 0; x < 8; ++x) {
-		for (int y = 0; y < 8; ++y) {
-			for (int z = 0; z < 8; ++z) {
+	for (int x = 0; x < (int)NX; ++x) {
+		for (int y = 0; y < (int)NY; ++y) {
+			for (int z = 0; z < (int)NZ; ++z) {
 				double dr = measured_rgb[0] - cube[x][y][z][0];
 				double dg = measured_rgb[1] - cube[x][y][z][1];
 				double db = measured_rgb[2] - cube[x][y][z][2];
-				double distance = sqrt(dr * dr + dg * dg + db * db);
+				// squared distance gives the same ordering, no need for sqrt
+				double distance = dr * dr + dg * dg + db * db;
 
 				if (distance < min_distance) {
 					min_distance = distance;
@@ -40,6 +54,88 @@ tuple<int, int, int> find_nearest_cube_index(const array<double, 3>& measured_rg
 	return make_tuple(best_x, best_y, best_z);
 }
 
+using Cube = array<array<array<array<double, 3>, 8>, 8>, 8>;
+
+// Transmitted value of each of the 8 cube levels
+constexpr std::array<double, 8> LEVEL_VALUES{ 0, 36, 73, 109, 146, 182, 219, 255 };
+
+// Cube levels measured in SparseLattice mode (indices into LEVEL_VALUES)
+constexpr std::array<int, 4> LATTICE_LEVELS{ 0, 2, 5, 7 };
+constexpr int LATTICE_SIZE = (int)LATTICE_LEVELS.size();
+using LatticeCube = array<array<array<array<double, 3>, LATTICE_SIZE>, LATTICE_SIZE>, LATTICE_SIZE>;
+
+// Finds the lattice cell containing cube level `level` and the position within it
+static std::pair<int, double> latticeSegment(int level) {
+	for (int s = 0; s < LATTICE_SIZE - 1; ++s) {
+		if (level <= LATTICE_LEVELS[s + 1]) {
+			double v0 = LEVEL_VALUES[LATTICE_LEVELS[s]];
+			double v1 = LEVEL_VALUES[LATTICE_LEVELS[s + 1]];
+			return { s, (LEVEL_VALUES[level] - v0) / (v1 - v0) };
+		}
+	}
+	return { LATTICE_SIZE - 2, 1.0 };
+}
+
+// Forward model: predicts how every point of the dense 8x8x8 cube looks on camera by
+// trilinear interpolation between the surrounding measured lattice points
+static Cube interpolateLatticeCube(const LatticeCube& lattice) {
+	Cube cube{};
+	for (int x = 0; x < 8; ++x) {
+		const auto [x0, wx] = latticeSegment(x);
+		for (int y = 0; y < 8; ++y) {
+			const auto [y0, wy] = latticeSegment(y);
+			for (int z = 0; z < 8; ++z) {
+				const auto [z0, wz] = latticeSegment(z);
+				const int x1 = x0 + 1, y1 = y0 + 1, z1 = z0 + 1;
+				for (int c = 0; c < 3; ++c) {
+					cube[x][y][z][c] =
+						lattice[x0][y0][z0][c] * (1 - wx) * (1 - wy) * (1 - wz) +
+						lattice[x1][y0][z0][c] * wx * (1 - wy) * (1 - wz) +
+						lattice[x0][y1][z0][c] * (1 - wx) * wy * (1 - wz) +
+						lattice[x0][y0][z1][c] * (1 - wx) * (1 - wy) * wz +
+						lattice[x1][y1][z0][c] * wx * wy * (1 - wz) +
+						lattice[x1][y0][z1][c] * wx * (1 - wy) * wz +
+						lattice[x0][y1][z1][c] * (1 - wx) * wy * wz +
+						lattice[x1][y1][z1][c] * wx * wy * wz;
+				}
+			}
+		}
+	}
+	return cube;
+}
+
+// Inverse of a key's cube as a table: measured colour quantised to 5 bits per channel ->
+// nearest cube point. Cells are filled the first time they're hit, so classification is
+// a table lookup without having to search all 32768 cells up front.
+class CubeLookup {
+public:
+	explicit CubeLookup(const Cube& cube) : m_cube(&cube), m_table(1 << (3 * BITS), EMPTY) {}
+
+	// px is BGR, returns cube indices in RGB order like find_nearest_cube_index
+	tuple<int, int, int> lookup(const cv::Vec3b& px)
+	{
+		const int r = px[2] >> (8 - BITS);
+		const int g = px[1] >> (8 - BITS);
+		const int b = px[0] >> (8 - BITS);
+		uint16_t& cell = m_table[(r << (2 * BITS)) | (g << BITS) | b];
+		if (cell == EMPTY) {
+			// classify the centre of the cell
+			constexpr double half = (1 << (8 - BITS)) / 2.0;
+			const auto [x, y, z] = find_nearest_cube_index(std::array<double, 3>{
+				(r << (8 - BITS)) + half, (g << (8 - BITS)) + half, (b << (8 - BITS)) + half }, *m_cube);
+			cell = static_cast<uint16_t>(x * 64 + y * 8 + z);
+		}
+		return make_tuple(cell / 64, (cell / 8) % 8, cell % 8);
+	}
+
+private:
+	static constexpr int BITS = 5;
+	static constexpr uint16_t EMPTY = 0xFFFF;
+
+	const Cube* m_cube;
+	std::vector<uint16_t> m_table;
+};
+
 // Trilinear interpolation
 array<double, 3> interpolate_rgb(const array<double, 3>& measured_rgb,
 	const array<array<array<array<double, 3>, 8>, 8>, 8>& cube,
@@ -185,13 +281,109 @@ static cv::Vec3b averageColor(std::span<const cv::Vec3b> colors) {
 	return res;
 }
 
-static cv::Vec3b findAvgColorWiithMask(const cv::Mat& img, const cv::Mat& mask, const Box& box) {
+enum class CalibrationMode {
+	PerBox,         // every palette entry measured on every box
+	SpatialSubset,  // full capture, but only every SPATIAL_BOX_STRIDE-th box is measured, the rest are predicted
+	SpatialRotated, // short capture where each box shows a different entry, see spatialCalibrationEntry()
+	SparseLattice,  // only the LATTICE_LEVELS^3 lattice is measured, the rest of the cube is interpolated
+};
+
+// Palette entry shown by a box in frame `frame` of a rotated calibration capture.
+// Every frame shows box_count consecutive entries so each entry turns up on different
+// boxes over the capture, and a few frames are enough to fit the spatial model.
+static int spatialCalibrationEntry(int box_index, int frame, int box_count, int palette_size) {
+	return (box_index + frame * box_count) % palette_size;
+}
+
+struct SpatialObservation {
+	int box_index;
+	int entry;
+	cv::Vec3b color;
+};
+
+// Terms of a quadratic in the box centre (normalised to -1..1 over the box layout)
+static std::array<double, 6> spatialTerms(const cv::Point2d& p) {
+	return { 1.0, p.x, p.y, p.x * p.x, p.x * p.y, p.y * p.y };
+}
+
+static std::vector<cv::Point2d> normalisedBoxCentres(const std::vector<Box>& boxes) {
+	double min_x = 1e9, max_x = -1e9, min_y = 1e9, max_y = -1e9;
+	for (const auto& box : boxes) {
+		min_x = std::min(min_x, box.x + box.w * 0.5);
+		max_x = std::max(max_x, box.x + box.w * 0.5);
+		min_y = std::min(min_y, box.y + box.h * 0.5);
+		max_y = std::max(max_y, box.y + box.h * 0.5);
+	}
+	std::vector<cv::Point2d> centres{};
+	for (const auto& box : boxes) {
+		double x = box.x + box.w * 0.5;
+		double y = box.y + box.h * 0.5;
+		centres.emplace_back(
+			(max_x > min_x) ? (x - min_x) / (max_x - min_x) * 2.0 - 1.0 : 0.0,
+			(max_y > min_y) ? (y - min_y) / (max_y - min_y) * 2.0 - 1.0 : 0.0);
+	}
+	return centres;
+}
+
+// Fits a smooth model of how each palette entry appears across the screen (a least squares
+// polynomial in box position per entry) and predicts the full per-box palettes from it.
+// Entries with few observations fall back to a plane or a constant.
+template <size_t N>
+static std::vector<std::array<cv::Vec3b, N>> predictSpatialPalettes(
+	const std::vector<SpatialObservation>& observations,
+	const std::vector<cv::Point2d>& box_centres)
+{
+	std::array<std::vector<const SpatialObservation*>, N> per_entry{};
+	for (const auto& obs : observations) {
+		per_entry.at(obs.entry).push_back(&obs);
+	}
+
+	std::vector<std::array<cv::Vec3b, N>> palettes(box_centres.size());
+	for (size_t entry = 0; entry < N; ++entry) {
+		const auto& obs = per_entry[entry];
+		if (obs.empty()) {
+			throw std::runtime_error(std::format("No calibration observations of palette entry {}", entry));
+		}
+
+		// keep a couple of spare observations per term so the fit doesn't chase noise
+		const int terms = (obs.size() >= 12) ? 6 : (obs.size() >= 6) ? 3 : 1;
+
+		cv::Mat A((int)obs.size(), terms, CV_64F);
+		cv::Mat B((int)obs.size(), 3, CV_64F);
+		for (int i = 0; i < (int)obs.size(); ++i) {
+			auto t = spatialTerms(box_centres.at(obs[i]->box_index));
+			for (int k = 0; k < terms; ++k) {
+				A.at<double>(i, k) = t[k];
+			}
+			for (int c = 0; c < 3; ++c) {
+				B.at<double>(i, c) = obs[i]->color[c];
+			}
+		}
+		cv::Mat X;
+		cv::solve(A, B, X, cv::DECOMP_SVD);
+
+		for (size_t box_index = 0; box_index < box_centres.size(); ++box_index) {
+			auto t = spatialTerms(box_centres[box_index]);
+			for (int c = 0; c < 3; ++c) {
+				double v = 0.0;
+				for (int k = 0; k < terms; ++k) {
+					v += t[k] * X.at<double>(k, c);
+				}
+				palettes[box_index][entry][c] = cv::saturate_cast<uchar>(v);
+			}
+		}
+	}
+	return palettes;
+}
+
+// img_origin is where img's top left pixel is in the full frame (non-zero for cached frames)
+static cv::Vec3b findAvgColorWiithMask(const cv::Mat& img, const cv::Mat& mask, const Box& box, cv::Point img_origin = {}) {
 	std::vector<cv::Vec3b> colors{};
 	for (int y = box.y; y < box.y + box.h; ++y) {
 		for (int x = box.x; x < box.x + box.w; ++x) {
 			auto test = mask.at<cv::Vec3b>(y, x);
 			if (mask.at<cv::Vec3b>(y, x)[1] == 255) {
-				colors.push_back(img.at<cv::Vec3b>(y, x));
+				colors.push_back(img.at<cv::Vec3b>(y - img_origin.y, x - img_origin.x));
 			}
 		}
 	}
@@ -205,9 +397,54 @@ int main()
 	std::string mask_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\mask2.png";
 	std::string bboxes_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\bboxes.csv";
 
+	// The classified image is also written here (directory or .avi/.mp4) by a background thread
+	constexpr bool DEBUG_OUTPUT = false;
+	std::string debug_output_path = "debug";
+
+	DebugOutput debug_output{};
+	if (DEBUG_OUTPUT) {
+		debug_output.open(debug_output_path);
+	}
+
+	constexpr CalibrationMode CALIBRATION_MODE = CalibrationMode::PerBox;
+	constexpr int SPATIAL_BOX_STRIDE = 4;
+	constexpr int SPATIAL_ROTATED_FRAMES = 64;
+	// take the lattice frames out of a full 512 frame capture, rather than a capture of only the lattice
+	constexpr bool SPARSE_FROM_FULL_CAPTURE = true;
+
+	int calibration_frames = 512;
+	if (CALIBRATION_MODE == CalibrationMode::SpatialRotated) {
+		calibration_frames = SPATIAL_ROTATED_FRAMES;
+	}
+	else if (CALIBRATION_MODE == CalibrationMode::SparseLattice) {
+		calibration_frames = LATTICE_SIZE * LATTICE_SIZE * LATTICE_SIZE;
+	}
+	// Read the calibration frames from a cache built by the framecache tool (if it exists) instead of decoding the PNGs:
+	// framecache <images_dir> <bboxes.csv> calibrate_frames.roic --frames 1829:24:512
+	// Nothing ties the cache to the images it was built from, rebuild it whenever they change
+	constexpr bool USE_FRAME_CACHE = false;
+	std::string frame_cache_path = "calibrate_frames.roic";
+
+	FrameCache frame_cache{};
+	if (USE_FRAME_CACHE && std::filesystem::exists(frame_cache_path)) {
+		frame_cache.open(frame_cache_path);
+	}
+	const cv::Point images_origin = frame_cache.isOpen() ? frame_cache.roi().tl() : cv::Point{};
+
 	std::vector<cv::Mat> images{};
-	for (int i = 0; i < 512; ++i) {
-		int frame = 1829 + (i * 24);
+	for (int i = 0; i < calibration_frames; ++i) {
+		int frame_index = i;
+		if (CALIBRATION_MODE == CalibrationMode::SparseLattice && SPARSE_FROM_FULL_CAPTURE) {
+			const int a = i / (LATTICE_SIZE * LATTICE_SIZE), b = (i / LATTICE_SIZE) % LATTICE_SIZE, c = i % LATTICE_SIZE;
+			frame_index = LATTICE_LEVELS[a] * 64 + LATTICE_LEVELS[b] * 8 + LATTICE_LEVELS[c];
+		}
+		int frame = 1829 + (frame_index * 24);
+		if (frame_cache.isOpen()) {
+			if (!frame_cache.frame(frame, images.emplace_back())) {
+				throw std::runtime_error(std::format("Frame {} is not in the frame cache", frame));
+			}
+			continue;
+		}
 		std::string filename = std::format("frame_{:06}.png", frame);
 		images.emplace_back(cv::imread((images_dir / filename).string()));
 	}
@@ -220,13 +457,52 @@ int main()
 	auto boxes = loadCsvBoxes(bboxes_path);
 
 	std::vector<std::array<cv::Vec3b, 512>> calibration_data{};
-	for (int i = 0; i < 109; ++i) {
-		calibration_data.push_back({});
-		auto& data = calibration_data.back();
-		for (int j = 0; j < 512; ++j) {
-			data[j] = findAvgColorWiithMask(images[j], mask, boxes[i]);
+	if (CALIBRATION_MODE == CalibrationMode::PerBox) {
+		for (int i = 0; i < 109; ++i) {
+			calibration_data.push_back({});
+			auto& data = calibration_data.back();
+			for (int j = 0; j < 512; ++j) {
+				data[j] = findAvgColorWiithMask(images[j], mask, boxes[i], images_origin);
+			}
 		}
 	}
+	else if (CALIBRATION_MODE == CalibrationMode::SparseLattice) {
+		for (int i = 0; i < 109; ++i) {
+			LatticeCube lattice{};
+			for (int j = 0; j < calibration_frames; ++j) {
+				const int a = j / (LATTICE_SIZE * LATTICE_SIZE), b = (j / LATTICE_SIZE) % LATTICE_SIZE, c = j % LATTICE_SIZE;
+				cv::Vec3b col = findAvgColorWiithMask(images[j], mask, boxes[i], images_origin);
+				lattice[a][b][c] = { (double)col[2], (double)col[1], (double)col[0] };
+			}
+			const Cube dense = interpolateLatticeCube(lattice);
+
+			calibration_data.push_back({});
+			auto& data = calibration_data.back();
+			for (int row = 0; row < 512; ++row) {
+				const auto& rgb = dense[row / 64][(row / 8) % 8][row % 8];
+				data[row] = cv::Vec3b(cv::saturate_cast<uchar>(rgb[2]), cv::saturate_cast<uchar>(rgb[1]), cv::saturate_cast<uchar>(rgb[0]));
+			}
+		}
+	}
+	else {
+		std::vector<SpatialObservation> observations{};
+		if (CALIBRATION_MODE == CalibrationMode::SpatialSubset) {
+			for (int i = 0; i < 109; i += SPATIAL_BOX_STRIDE) {
+				for (int j = 0; j < 512; ++j) {
+					observations.push_back({ i, j, findAvgColorWiithMask(images[j], mask, boxes[i], images_origin) });
+				}
+			}
+		}
+		else {
+			for (int f = 0; f < calibration_frames; ++f) {
+				for (int i = 0; i < 109; ++i) {
+					int entry = spatialCalibrationEntry(i, f, 109, 512);
+					observations.push_back({ i, entry, findAvgColorWiithMask(images[f], mask, boxes[i], images_origin) });
+				}
+			}
+		}
+		calibration_data = predictSpatialPalettes<512>(observations, normalisedBoxCentres(boxes));
+	}
 
 	std::string received_image_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\mandrill_rec.png";
 	cv::Mat received_image = cv::imread(received_image_path);
@@ -234,56 +510,98 @@ int main()
 		throw std::runtime_error("Failed to read mask image");
 	}
 
-	for (int i = 0; i < 16384; ++i) {
-
-		std::cout << i << "\n";
-
-		int key_index = i % 109;
-
-		std::array<double, 512> R_measured{};
-		std::array<double, 512> G_measured{};
-		std::array<double, 512> B_measured{};
-		for (int j = 0; j < 512; ++j) {
-			R_measured[j] = calibration_data[key_index][j][2];
-			G_measured[j] = calibration_data[key_index][j][1];
-			B_measured[j] = calibration_data[key_index][j][0];
-		}
-
-		// Build 8x8x8 cube
-		array<array<array<array<double, 3>, 8>, 8>, 8> cube;
+	// Build 8x8x8 cube for each key, once up front rather than per pixel
+	std::vector<Cube> cubes(calibration_data.size());
+	for (size_t key_index = 0; key_index < calibration_data.size(); ++key_index) {
+		auto& cube = cubes[key_index];
 		for (int x = 0; x < 8; ++x) {
 			for (int y = 0; y < 8; ++y) {
 				for (int z = 0; z < 8; ++z) {
 					int row = x * 64 + y * 8 + z;
-					cube[x][y][z][0] = R_measured[row];
-					cube[x][y][z][1] = G_measured[row];
-					cube[x][y][z][2] = B_measured[row];
+					cube[x][y][z][0] = calibration_data[key_index][row][2];
+					cube[x][y][z][1] = calibration_data[key_index][row][1];
+					cube[x][y][z][2] = calibration_data[key_index][row][0];
 				}
 			}
 		}
+	}
 
-		constexpr std::array<double, 8> channel_values{ 0, 36, 73, 109, 146, 182, 219, 255 };
+	// sparse calibration classifies through a per-key table rather than searching the cube for every pixel
+	std::vector<CubeLookup> lookups{};
+	if (CALIBRATION_MODE == CalibrationMode::SparseLattice) {
+		for (const auto& cube : cubes) {
+			lookups.emplace_back(cube);
+		}
+	}
 
-		int x = i % 128;
-		int y = i / 128;
-		cv::Vec3b& px = received_image.at<cv::Vec3b>(y, x);
+	constexpr std::array<double, 8> channel_values{ 0, 36, 73, 109, 146, 182, 219, 255 };
+
+	// the image can be any size, its pixels were sent in raster order, one per box
+	const int image_width = received_image.cols;
+	const int image_height = received_image.rows;
+
+	// binary ppm, each row is written out as soon as all its pixels are classified
+	ChunkedWriter ppm_output("linear.ppm", "linear_chunks.csv");
+	ppm_output.writeHeader(std::format("P6\n{} {}\n255\n", image_width, image_height));
+
+	// Rows are classified CLASSIFY_BATCH_ROWS at a time, in parallel across keys. Pixel i was sent by key
+	// i % key_count, so every pixel (and CubeLookup, which fills in as it goes) belongs to exactly one thread.
+	constexpr int CLASSIFY_BATCH_ROWS = 32;
+	const int key_count = (int)cubes.size();
+	ProgressReporter progress("Classified pixels", (size_t)image_width * image_height);
+
+	for (int batch_y = 0; batch_y < image_height; batch_y += CLASSIFY_BATCH_ROWS) {
+		const int batch_end_y = std::min(batch_y + CLASSIFY_BATCH_ROWS, image_height);
+		const int batch_begin = batch_y * image_width;
+		const int batch_end = batch_end_y * image_width;
+
+		cv::parallel_for_(cv::Range(0, key_count), [&](const cv::Range& range) {
+			for (int key_index = range.start; key_index < range.end; ++key_index) {
+				const Cube& cube = cubes[key_index];
+				// first pixel of the batch sent by this key
+				const int first = batch_begin + ((key_index - batch_begin % key_count) + key_count) % key_count;
+				for (int i = first; i < batch_end; i += key_count) {
+					int x = i % image_width;
+					int y = i / image_width;
+					cv::Vec3b& px = received_image.at<cv::Vec3b>(y, x);
 #if 1
-		const auto [i1, i2, i3] = find_nearest_cube_index(std::array<double, 3>{static_cast<double>(px[2]), static_cast<double>(px[1]), static_cast<double>(px[0])}, cube);
-		px[2] = colFromIndex(i1);
-		px[1] = colFromIndex(i2);
-		px[0] = colFromIndex(i3);
+					const auto [i1, i2, i3] = lookups.empty()
+						? find_nearest_cube_index(std::array<double, 3>{static_cast<double>(px[2]), static_cast<double>(px[1]), static_cast<double>(px[0])}, cube)
+						: lookups[key_index].lookup(px);
+					px[2] = colFromIndex(i1);
+					px[1] = colFromIndex(i2);
+					px[0] = colFromIndex(i3);
 #else
-		auto res = interpolate_rgb(std::array<double, 3>{static_cast<double>(px[2]), static_cast<double>(px[1]), static_cast<double>(px[0])}, cube, channel_values);
-		px[2] = res[0];
-		px[1] = res[1];
-		px[0] = res[2];
+					auto res = interpolate_rgb(std::array<double, 3>{static_cast<double>(px[2]), static_cast<double>(px[1]), static_cast<double>(px[0])}, cube, channel_values);
+					px[2] = res[0];
+					px[1] = res[1];
+					px[0] = res[2];
 #endif
-
+				}
+			}
+			});
+
+		for (int y = batch_y; y < batch_end_y; ++y) {
+			std::string row(image_width * 3, '\0');
+			for (int row_x = 0; row_x < image_width; ++row_x) {
+				const cv::Vec3b& row_px = received_image.at<cv::Vec3b>(y, row_x);
+				// ppm is RGB
+				row[row_x * 3 + 0] = row_px[2];
+				row[row_x * 3 + 1] = row_px[1];
+				row[row_x * 3 + 2] = row_px[0];
+			}
+			ppm_output.writeChunk(row);
+		}
+		progress.update(batch_end);
 	}
+	progress.finish((size_t)image_width * image_height);
 
-	cv::imshow("image", received_image);
 	cv::imwrite("linear.png", received_image);
-	cv::waitKey();
+	debug_output.submit("linear", [img = received_image.clone()] {
+		cv::Mat out;
+		cv::resize(img, out, cv::Size{ 512, 512 }, 0, 0, cv::INTER_NEAREST);
+		return out;
+		});
 
 	return 0;
 }
\ No newline at end of file
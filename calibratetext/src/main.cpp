@@ -7,25 +7,37 @@
 #include <span>
 #include <array>
 #include <filesystem>
+#include <chrono>
+#include <format>
 
 #include <opencv2/opencv.hpp>
 
+#include "frame_cache.h"
+#include "chunked_writer.h"
+#include "palette_tracker.h"
+#include "closest_match.h"
+#include "payload_decoder.h"
+#include "progress_reporter.h"
+
 using namespace std;
 
 // Function to find nearest cube index
+// Templated on the cube dimensions so the search loops can be fully unrolled
+template <size_t NX, size_t NY, size_t NZ>
 tuple<int, int, int> find_nearest_cube_index(const array<double, 3>& measured_rgb,
-	const array<array<array<array<double, 3>, 4>, 8>, 4>& cube)
+	const array<array<array<array<double, 3>, NZ>, NY>, NX>& cube)
 {
 	double min_distance = 1e9; // initialize with a large number
 	int best_x = 0, best_y = 0, best_z = 0;
 
-	for (int x = 0; x < 4; ++x) {
-		for (int y = 0; y < 8; ++y) {
-			for (int z = 0; z < 4; ++z) {
+	for (int x = 0; x < (int)NX; ++x) {
+		for (int y = 0; y < (int)NY; ++y) {
+			for (int z = 0; z < (int)NZ; ++z) {
 				double dr = measured_rgb[0] - cube[x][y][z][0];
 				double dg = measured_rgb[1] - cube[x][y][z][1];
 				double db = measured_rgb[2] - cube[x][y][z][2];
-				double distance = sqrt(dr * dr + dg * dg + db * db);
+				// squared distance gives the same ordering, no need for sqrt
+				double distance = dr * dr + dg * dg + db * db;
 
 				if (distance < min_distance) {
 					min_distance = distance;
@@ -40,38 +52,23 @@ tuple<int, int, int> find_nearest_cube_index(const array<double, 3>& measured_rg
 	return make_tuple(best_x, best_y, best_z);
 }
 
-// cv::Vec3b is BGR
-static std::vector<cv::Vec3b> loadColorData(const std::string& filename) {
-	std::vector<cv::Vec3b> data{};
-	std::ifstream file(filename);
-	if (!file.is_open()) {
-		throw std::runtime_error("Could not open file: " + filename);
-	}
-
+// Reads the next color from a "r,g,b" csv, cv::Vec3b is BGR
+static bool readColorLine(std::istream& file, cv::Vec3b& col) {
 	std::string line;
+	do {
+		if (!std::getline(file, line)) {
+			return false;
+		}
+	} while (line.empty());
 
-	// Skip header line
-	if (!std::getline(file, line)) {
-		return data; // empty file
-	}
-
-	// Parse data lines
-	while (std::getline(file, line)) {
-		if (line.empty()) continue;
-
-		std::stringstream ss(line);
-		std::string token;
-
-		cv::Vec3b col;
-
-		if (std::getline(ss, token, ',')) col[2] = std::stoi(token);
-		if (std::getline(ss, token, ',')) col[1] = std::stoi(token);
-		if (std::getline(ss, token, ',')) col[0] = std::stoi(token);
+	std::stringstream ss(line);
+	std::string token;
 
-		data.push_back(col);
-	}
+	if (std::getline(ss, token, ',')) col[2] = std::stoi(token);
+	if (std::getline(ss, token, ',')) col[1] = std::stoi(token);
+	if (std::getline(ss, token, ',')) col[0] = std::stoi(token);
 
-	return data;
+	return true;
 }
 
 struct Box {
@@ -178,10 +175,14 @@ static std::array<int, 2> lookupMaskCoordinate(int x, int y, const cv::Mat& H)
 	return std::array<int, 2>{(int)roundf(dstPnt[0].x), (int)roundf(dstPnt[0].y)};
 }
 
-static cv::Vec3b findAvgColorWiithMask(const cv::Mat& img, const cv::Mat& mask, const std::array<cv::Point2f, 4>& box, const cv::Mat& H_inv) {
+// img_origin is where img's top left pixel is in the full frame (non-zero for cached frames)
+static cv::Vec3b findAvgColorWiithMask(const cv::Mat& img, const cv::Mat& mask, std::array<cv::Point2f, 4> box, const cv::Mat& H_inv, cv::Point img_origin = {}) {
+	for (auto& corner : box) {
+		corner -= cv::Point2f(img_origin);
+	}
 	std::vector<cv::Vec3b> colors{};
 	pixelsInQuad(box, img, [&](int x, int y) {
-		auto coords = lookupMaskCoordinate(x, y, H_inv);
+		auto coords = lookupMaskCoordinate(x + img_origin.x, y + img_origin.y, H_inv);
 		//std::cout << "test\n";
 		if (mask.at<cv::Vec3b>(coords[1], coords[0])[1] == 255) {
 			colors.push_back(img.at<cv::Vec3b>(y, x));
@@ -192,34 +193,134 @@ static cv::Vec3b findAvgColorWiithMask(const cv::Mat& img, const cv::Mat& mask,
 	return averageColor(colors);
 }
 
-// Computes squared Euclidean distance between two BGR colors
-static inline int colorDistanceSq(const cv::Vec3b& a, const cv::Vec3b& b)
-{
-	int db = int(a[0]) - int(b[0]);
-	int dg = int(a[1]) - int(b[1]);
-	int dr = int(a[2]) - int(b[2]);
-	return db * db + dg * dg + dr * dr;
-}
+// How well a key's palette can be told apart, and how often received colours were ambiguous on it
+struct KeyQuality {
+	float min_separation = 0.0f; // distance between the palette's two closest entries
+	int confusable_pairs = 0;    // pairs of entries closer than the confusable distance
+	int received = 0;
+	int ambiguous = 0;           // received colours nearly as close to the runner up entry (likely erasures)
+};
 
-// Finds closest color from a list
-int findClosestColor(const cv::Vec3b& inputColor, const std::array<cv::Vec3b, 128>& palette)
-{
-	int bestIndex = 0;
-	int bestDist = INT_MAX;
-
-	for (int i = 0; i < (int)palette.size(); i++)
-	{
-		int dist = colorDistanceSq(inputColor, palette[i]);
-		if (dist < bestDist)
-		{
-			bestDist = dist;
-			bestIndex = i;
+template <std::size_t N>
+static KeyQuality paletteQuality(const std::array<cv::Vec3b, N>& palette, float confusable_distance) {
+	KeyQuality quality{};
+	int min_dist = std::numeric_limits<int>::max();
+	for (std::size_t a = 0; a < N; ++a) {
+		for (std::size_t b = a + 1; b < N; ++b) {
+			const int dist = colorDistanceSq(palette[a], palette[b]);
+			min_dist = std::min(min_dist, dist);
+			quality.confusable_pairs += dist < confusable_distance * confusable_distance;
 		}
 	}
+	quality.min_separation = std::sqrt((float)min_dist);
+	return quality;
+}
+
+static void writeKeyQualityReport(const std::string& path, const std::vector<KeyQuality>& quality) {
+	std::ofstream file(path);
+	if (!file) {
+		throw std::runtime_error("Failed to create file for writing");
+	}
+	file << "key,min_separation,confusable_pairs,received,ambiguous\n";
+	for (std::size_t key_index = 0; key_index < quality.size(); ++key_index) {
+		const auto& q = quality[key_index];
+		file << std::format("{},{:.1f},{},{},{}\n", key_index, q.min_separation, q.confusable_pairs, q.received, q.ambiguous);
+	}
+}
+
+enum class CalibrationMode {
+	PerBox,         // every palette entry measured on every box
+	SpatialSubset,  // full capture, but only every SPATIAL_BOX_STRIDE-th box is measured, the rest are predicted
+	SpatialRotated, // short capture where each box shows a different entry, see spatialCalibrationEntry()
+};
+
+// Palette entry shown by a box in frame `frame` of a rotated calibration capture.
+// Every frame shows box_count consecutive entries so each entry turns up on different
+// boxes over the capture, and a few frames are enough to fit the spatial model.
+static int spatialCalibrationEntry(int box_index, int frame, int box_count, int palette_size) {
+	return (box_index + frame * box_count) % palette_size;
+}
+
+struct SpatialObservation {
+	int box_index;
+	int entry;
+	cv::Vec3b color;
+};
 
-	return bestIndex;
+// Terms of a quadratic in the box centre (normalised to -1..1 over the box layout)
+static std::array<double, 6> spatialTerms(const cv::Point2d& p) {
+	return { 1.0, p.x, p.y, p.x * p.x, p.x * p.y, p.y * p.y };
 }
 
+static std::vector<cv::Point2d> normalisedBoxCentres(const std::vector<Box>& boxes) {
+	double min_x = 1e9, max_x = -1e9, min_y = 1e9, max_y = -1e9;
+	for (const auto& box : boxes) {
+		min_x = std::min(min_x, box.x + box.w * 0.5);
+		max_x = std::max(max_x, box.x + box.w * 0.5);
+		min_y = std::min(min_y, box.y + box.h * 0.5);
+		max_y = std::max(max_y, box.y + box.h * 0.5);
+	}
+	std::vector<cv::Point2d> centres{};
+	for (const auto& box : boxes) {
+		double x = box.x + box.w * 0.5;
+		double y = box.y + box.h * 0.5;
+		centres.emplace_back(
+			(max_x > min_x) ? (x - min_x) / (max_x - min_x) * 2.0 - 1.0 : 0.0,
+			(max_y > min_y) ? (y - min_y) / (max_y - min_y) * 2.0 - 1.0 : 0.0);
+	}
+	return centres;
+}
+
+// Fits a smooth model of how each palette entry appears across the screen (a least squares
+// polynomial in box position per entry) and predicts the full per-box palettes from it.
+// Entries with few observations fall back to a plane or a constant.
+template <size_t N>
+static std::vector<std::array<cv::Vec3b, N>> predictSpatialPalettes(
+	const std::vector<SpatialObservation>& observations,
+	const std::vector<cv::Point2d>& box_centres)
+{
+	std::array<std::vector<const SpatialObservation*>, N> per_entry{};
+	for (const auto& obs : observations) {
+		per_entry.at(obs.entry).push_back(&obs);
+	}
+
+	std::vector<std::array<cv::Vec3b, N>> palettes(box_centres.size());
+	for (size_t entry = 0; entry < N; ++entry) {
+		const auto& obs = per_entry[entry];
+		if (obs.empty()) {
+			throw std::runtime_error(std::format("No calibration observations of palette entry {}", entry));
+		}
+
+		// keep a couple of spare observations per term so the fit doesn't chase noise
+		const int terms = (obs.size() >= 12) ? 6 : (obs.size() >= 6) ? 3 : 1;
+
+		cv::Mat A((int)obs.size(), terms, CV_64F);
+		cv::Mat B((int)obs.size(), 3, CV_64F);
+		for (int i = 0; i < (int)obs.size(); ++i) {
+			auto t = spatialTerms(box_centres.at(obs[i]->box_index));
+			for (int k = 0; k < terms; ++k) {
+				A.at<double>(i, k) = t[k];
+			}
+			for (int c = 0; c < 3; ++c) {
+				B.at<double>(i, c) = obs[i]->color[c];
+			}
+		}
+		cv::Mat X;
+		cv::solve(A, B, X, cv::DECOMP_SVD);
+
+		for (size_t box_index = 0; box_index < box_centres.size(); ++box_index) {
+			auto t = spatialTerms(box_centres[box_index]);
+			for (int c = 0; c < 3; ++c) {
+				double v = 0.0;
+				for (int k = 0; k < terms; ++k) {
+					v += t[k] * X.at<double>(k, c);
+				}
+				palettes[box_index][entry][c] = cv::saturate_cast<uchar>(v);
+			}
+		}
+	}
+	return palettes;
+}
 
 int main()
 {
@@ -227,9 +328,32 @@ int main()
 	std::string mask_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\mask2.png";
 	std::string bboxes_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\bboxes.csv";
 
+	constexpr CalibrationMode CALIBRATION_MODE = CalibrationMode::PerBox;
+	constexpr int SPATIAL_BOX_STRIDE = 4;
+	constexpr int SPATIAL_ROTATED_FRAMES = 16;
+
+	const int calibration_frames = (CALIBRATION_MODE == CalibrationMode::SpatialRotated) ? SPATIAL_ROTATED_FRAMES : 128;
+	// Read the calibration frames from a cache built by the framecache tool (if it exists) instead of decoding the PNGs:
+	// framecache <images_dir> <bboxes.csv> calibratetext_frames.roic --frames 928:24:128 --corners 38.9,48.3,2010.3,-20.6,54.3,1114.1,2022.2,1126.5
+	// Nothing ties the cache to the images it was built from, rebuild it whenever they change
+	constexpr bool USE_FRAME_CACHE = false;
+	std::string frame_cache_path = "calibratetext_frames.roic";
+
+	FrameCache frame_cache{};
+	if (USE_FRAME_CACHE && std::filesystem::exists(frame_cache_path)) {
+		frame_cache.open(frame_cache_path);
+	}
+	const cv::Point images_origin = frame_cache.isOpen() ? frame_cache.roi().tl() : cv::Point{};
+
 	std::vector<cv::Mat> images{};
-	for (int i = 0; i < 128; ++i) {
+	for (int i = 0; i < calibration_frames; ++i) {
 		int frame = 928 + (i * 24);
+		if (frame_cache.isOpen()) {
+			if (!frame_cache.frame(frame, images.emplace_back())) {
+				throw std::runtime_error(std::format("Frame {} is not in the frame cache", frame));
+			}
+			continue;
+		}
 		std::string filename = std::format("frame_{:06}.png", frame);
 		images.emplace_back(cv::imread((images_dir / filename).string()));
 	}
@@ -273,37 +397,135 @@ int main()
 	}
 
 	std::vector<std::array<cv::Vec3b, 128>> calibration_data{};
-	for (int i = 0; i < 109; ++i) {
-		calibration_data.push_back({});
-		auto& data = calibration_data.back();
-		for (int j = 0; j < 128; ++j) {
-			data[j] = findAvgColorWiithMask(images[j], mask, transformed_boxes[i], H_inv);
+	if (CALIBRATION_MODE == CalibrationMode::PerBox) {
+		for (int i = 0; i < 109; ++i) {
+			calibration_data.push_back({});
+			auto& data = calibration_data.back();
+			for (int j = 0; j < 128; ++j) {
+				data[j] = findAvgColorWiithMask(images[j], mask, transformed_boxes[i], H_inv, images_origin);
+			}
 		}
 	}
+	else {
+		std::vector<SpatialObservation> observations{};
+		if (CALIBRATION_MODE == CalibrationMode::SpatialSubset) {
+			for (int i = 0; i < 109; i += SPATIAL_BOX_STRIDE) {
+				for (int j = 0; j < 128; ++j) {
+					observations.push_back({ i, j, findAvgColorWiithMask(images[j], mask, transformed_boxes[i], H_inv, images_origin) });
+				}
+			}
+		}
+		else {
+			for (int f = 0; f < calibration_frames; ++f) {
+				for (int i = 0; i < 109; ++i) {
+					int entry = spatialCalibrationEntry(i, f, 109, 128);
+					observations.push_back({ i, entry, findAvgColorWiithMask(images[f], mask, transformed_boxes[i], H_inv, images_origin) });
+				}
+			}
+		}
+		calibration_data = predictSpatialPalettes<128>(observations, normalisedBoxCentres(boxes));
+	}
 
-	std::string received_text_csv = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\text\\text_colors.csv";
-	auto received_text_colors = loadColorData(received_text_csv);
-
-	std::string out_str{};
-
-	for (int i = 0; i < received_text_colors.size(); ++i) {
+	// Palette drift tracking, see PaletteTracker. 0 disables it, around 0.05 follows slow lighting changes
+	constexpr float DRIFT_ALPHA = 0.0f;
+	constexpr float DRIFT_MAX_DISTANCE_RATIO = 0.5f;
 
-		std::cout << i << "\n";
+	std::vector<PaletteTracker<128>> palette_trackers{};
+	for (auto& palette : calibration_data) {
+		palette_trackers.emplace_back(palette, DRIFT_ALPHA, DRIFT_MAX_DISTANCE_RATIO);
+	}
 
-		int key_index = i % 109;
-		const auto& palette = calibration_data[key_index];
+	// Per key quality report (key_quality.csv): entries closer than CONFUSABLE_DISTANCE are easily confused,
+	// and received colours at least AMBIGUOUS_RATIO as far from their entry as from the runner up are likely erasures
+	constexpr float CONFUSABLE_DISTANCE = 12.0f;
+	constexpr float AMBIGUOUS_RATIO = 0.6f;
+	std::vector<KeyQuality> key_quality{};
+	for (const auto& palette : calibration_data) {
+		key_quality.push_back(paletteQuality(palette, CONFUSABLE_DISTANCE));
+	}
 
-		int res = findClosestColor(received_text_colors[i], palette);
-		out_str.push_back(res);
+	std::string received_text_csv = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\text\\text_colors.csv";
+	std::ifstream received_text_colors(received_text_csv);
+	if (!received_text_colors.is_open()) {
+		throw std::runtime_error("Could not open file: " + received_text_csv);
 	}
+	std::string header;
+	std::getline(received_text_colors, header);
+
+	// The characters carry a compressed payload (see PayloadDecoder) rather than plain text
+	constexpr bool COMPRESSED_PAYLOAD = false;
+	PayloadDecoder payload{};
+
+	// one chunk per frame of received colors, written as soon as it's classified
+	ChunkedWriter text_output("text_output.txt", "text_output_chunks.csv");
+
+	// Colours are classified CLASSIFY_BATCH_FRAMES frames at a time, in parallel across keys. Each key's
+	// colours are still classified in order so its PaletteTracker sees the same sequence as before.
+	constexpr int KEY_COUNT = 109;
+	constexpr int CLASSIFY_BATCH_FRAMES = 64;
+	std::vector<cv::Vec3b> batch_colors{};
+	std::string batch_chars{};
+	size_t classified = 0;
+	ProgressReporter progress("Classified colours", 0);
+
+	cv::Vec3b received_color{};
+	bool more = true;
+	while (more) {
+		batch_colors.clear();
+		while (batch_colors.size() < KEY_COUNT * CLASSIFY_BATCH_FRAMES) {
+			if (!readColorLine(received_text_colors, received_color)) {
+				more = false;
+				break;
+			}
+			batch_colors.push_back(received_color);
+		}
+		if (batch_colors.empty()) break;
+
+		// batches are whole frames, so the first colour of a batch is always key 0
+		batch_chars.resize(batch_colors.size());
+		cv::parallel_for_(cv::Range(0, KEY_COUNT), [&](const cv::Range& range) {
+			for (int key_index = range.start; key_index < range.end; ++key_index) {
+				const auto& palette = calibration_data[key_index];
+				for (size_t i = key_index; i < batch_colors.size(); i += KEY_COUNT) {
+					auto match = findClosestMatch(batch_colors[i], palette);
+					palette_trackers[key_index].update(match, batch_colors[i]);
+					++key_quality[key_index].received;
+					if (match.dist >= AMBIGUOUS_RATIO * AMBIGUOUS_RATIO * match.second_dist) {
+						++key_quality[key_index].ambiguous;
+					}
+					batch_chars[i] = (char)match.index;
+				}
+			}
+			});
+
+		for (size_t frame_begin = 0; frame_begin < batch_chars.size(); frame_begin += KEY_COUNT) {
+			std::string_view frame_chars = std::string_view(batch_chars).substr(frame_begin, KEY_COUNT);
+			if (COMPRESSED_PAYLOAD) {
+				std::string chunk{};
+				for (const char c : frame_chars) {
+					chunk += payload.push(c);
+				}
+				text_output.writeChunk(chunk);
+			}
+			else {
+				text_output.writeChunk(frame_chars);
+			}
+		}
 
-	{
-		std::ofstream text_output("text_output.txt");
-		if (!text_output) {
-			throw std::runtime_error("Failed to create file for writing");
+		classified += batch_colors.size();
+		progress.update(classified);
+	}
+	progress.finish(classified);
+	if (COMPRESSED_PAYLOAD) {
+		if (payload.valid()) {
+			std::cout << "Payload: " << payload.status() << "\n";
+		}
+		else {
+			std::cout << "Payload invalid: " << payload.status() << "\n";
 		}
-		text_output << out_str;
 	}
 
+	writeKeyQualityReport("key_quality.csv", key_quality);
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,343 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <array>
+#include <bit>
+#include <memory>
+
+#include <opencv2/opencv.hpp>
+
+#include "chunked_writer.h"
+#include "decoder_session.h"
+
+constexpr int SECTION_COUNT = DECODER_SECTION_COUNT;
+constexpr int LEVEL_COUNT = DECODER_LEVEL_COUNT;
+
+// The three characters and parity sections of one symbol: sections 0-6 carry bit n of each character,
+// section 7 the parity of each character
+struct LevelSymbol {
+	std::array<char, 3> chars{};
+	int parity_errors = 0;
+};
+
+static LevelSymbol decodeLevels(const std::array<int, SECTION_COUNT>& levels) {
+	LevelSymbol res{};
+	for (int j = 0; j < 3; ++j) {
+		for (int section_index = 0; section_index < 7; ++section_index) {
+			if (((levels[section_index] >> j) & 1) == 1) {
+				res.chars[j] |= (1 << section_index);
+			}
+		}
+		const bool parity = ((levels[7] >> j) & 1) == 1;
+		if ((std::popcount(static_cast<unsigned char>(res.chars[j])) & 1) != parity) {
+			++res.parity_errors;
+		}
+	}
+	return res;
+}
+
+// One capture's view of a symbol
+struct SymbolMeasurement {
+	bool ok = false; // false if the capture doesn't have the frame
+	std::array<cv::Vec3f, SECTION_COUNT> colors{};
+	// negative log likelihood of each level of each section, up to a constant
+	std::array<std::array<float, LEVEL_COUNT>, SECTION_COUNT> costs{};
+};
+
+static std::array<int, SECTION_COUNT> cheapestLevels(const std::array<std::array<float, LEVEL_COUNT>, SECTION_COUNT>& costs) {
+	std::array<int, SECTION_COUNT> res{};
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		res[section_index] = (int)(std::ranges::min_element(costs[section_index]) - costs[section_index].begin());
+	}
+	return res;
+}
+
+// One recording of the transmission
+struct CaptureConfig {
+	std::string name;
+	std::string video_path;
+	std::string bboxes_path;
+	std::string mask_path;
+	int calibration_start_frame; // level n is shown calibration_start_frame + n * 2 * symbol_frames
+	int decode_start_frame;      // symbol 0, the same symbol in every capture
+	int symbol_frames;           // frames each symbol is shown for, depends on the capture's frame rate
+	std::array<cv::Point2f, 4> corners; // order topleft, topright, bottomleft, bottomright
+};
+
+// captures.csv, one capture per line after the header:
+// name,video,bboxes,mask,calibration_start_frame,decode_start_frame,symbol_frames,x0,y0,x1,y1,x2,y2,x3,y3
+static std::vector<CaptureConfig> loadCaptures(const std::string& filename) {
+	std::vector<CaptureConfig> captures;
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + filename);
+	}
+
+	std::string line;
+
+	// Skip header line
+	if (!std::getline(file, line)) {
+		return captures; // empty file
+	}
+
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') continue;
+
+		std::stringstream ss(line);
+		std::vector<std::string> tokens{};
+		std::string token;
+		while (std::getline(ss, token, ',')) {
+			tokens.push_back(token);
+		}
+		if (tokens.size() != 15) {
+			throw std::runtime_error("Expected 15 columns in capture: " + line);
+		}
+
+		CaptureConfig c{};
+		c.name = tokens[0];
+		c.video_path = tokens[1];
+		c.bboxes_path = tokens[2];
+		c.mask_path = tokens[3];
+		c.calibration_start_frame = std::stoi(tokens[4]);
+		c.decode_start_frame = std::stoi(tokens[5]);
+		c.symbol_frames = std::stoi(tokens[6]);
+		if (c.symbol_frames <= 0) {
+			throw std::runtime_error("symbol_frames must be positive in capture: " + line);
+		}
+		for (int i = 0; i < 4; ++i) {
+			c.corners[i] = cv::Point2f(std::stof(tokens[7 + i * 2]), std::stof(tokens[8 + i * 2]));
+		}
+
+		captures.push_back(c);
+	}
+
+	return captures;
+}
+
+// Reads, calibrates and measures one capture with its own homography. The captures share no state,
+// so they can all measure their frames at the same time.
+class CaptureDecoder {
+public:
+	explicit CaptureDecoder(const CaptureConfig& config)
+		: m_config(config)
+	{
+		m_cap.open(config.video_path);
+		if (!m_cap.isOpened()) {
+			throw std::runtime_error("Could not open video: " + config.video_path);
+		}
+		const cv::Size frame_size((int)m_cap.get(cv::CAP_PROP_FRAME_WIDTH), (int)m_cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+
+		// sampled with decoderlib's geometry, the same pixels as decode_service would use
+		DecoderConfig geometry_config{};
+		geometry_config.mask = cv::imread(config.mask_path);
+		if (geometry_config.mask.empty()) {
+			throw std::runtime_error("Failed to read mask image: " + config.mask_path);
+		}
+
+		geometry_config.boxes = loadDecoderBoxes(config.bboxes_path);
+		if (geometry_config.boxes.size() != DECODER_BOX_COUNT) {
+			throw std::runtime_error("Capture " + config.name + " needs " + std::to_string(DECODER_BOX_COUNT) + " boxes");
+		}
+		geometry_config.corners = config.corners;
+		geometry_config.frame_size = frame_size;
+		m_geometry = computeDecoderGeometry(geometry_config);
+	}
+
+	const std::string& name() const { return m_config.name; }
+	int errors() const { return m_errors; }
+
+	// Measures every level on CALIBRATION_SAMPLES frames around its calibration frame. The palette is their
+	// average and the spread of each section around it is how much this capture's measurements are trusted.
+	void calibrate()
+	{
+		cv::Mat frame;
+		std::array<float, SECTION_COUNT> scatter{};
+		int dof = 0;
+		for (int level = 0; level < LEVEL_COUNT; ++level) {
+			std::array<std::vector<cv::Vec3f>, SECTION_COUNT> samples{};
+			for (int sample = 0; sample < CALIBRATION_SAMPLES; ++sample) {
+				const int frame_index = m_config.calibration_start_frame + level * 2 * m_config.symbol_frames
+					+ (sample - CALIBRATION_SAMPLES / 2) * CALIBRATION_SAMPLE_SPACING;
+				if (!readFrame(frame_index, frame)) {
+					throw std::runtime_error("Capture " + m_config.name + " is missing calibration frame " + std::to_string(frame_index));
+				}
+				auto section_colors = sampleDecoderSections(*m_geometry, frame);
+				for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+					samples[section_index].push_back(section_colors[section_index]);
+				}
+			}
+
+			for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+				cv::Vec3f mean{};
+				for (const auto& c : samples[section_index]) {
+					mean += c;
+				}
+				mean *= 1.0 / samples[section_index].size();
+				m_palettes[section_index][level] = mean;
+				for (const auto& c : samples[section_index]) {
+					scatter[section_index] += (float)cv::norm(c - mean, cv::NORM_L2SQR);
+				}
+			}
+			dof += CALIBRATION_SAMPLES - 1;
+		}
+
+		for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+			// per channel variance
+			const float variance = dof > 0 ? scatter[section_index] / (3.0f * dof) : 0.0f;
+			m_inv_two_variance[section_index] = 1.0f / (2.0f * (variance + NOISE_FLOOR * NOISE_FLOOR));
+		}
+	}
+
+	SymbolMeasurement measure(int symbol)
+	{
+		SymbolMeasurement res{};
+		if (!readFrame(m_config.decode_start_frame + symbol * m_config.symbol_frames, m_frame)) {
+			return res;
+		}
+		res.ok = true;
+		res.colors = sampleDecoderSections(*m_geometry, m_frame);
+		for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+			for (int level = 0; level < LEVEL_COUNT; ++level) {
+				res.costs[section_index][level] = (float)cv::norm(res.colors[section_index] - m_palettes[section_index][level], cv::NORM_L2SQR)
+					* m_inv_two_variance[section_index];
+			}
+		}
+		return res;
+	}
+
+	// Decides the symbol from this capture alone, only to report how the combination compares
+	void countErrors(const SymbolMeasurement& measurement)
+	{
+		m_errors += measurement.ok ? decodeLevels(cheapestLevels(measurement.costs)).parity_errors : 3;
+	}
+
+	// Palette drift tracking: pulls the entries of the combined decision towards this capture's colours.
+	// Only called for symbols that passed parity, so a wrong decision can't drag the palette away.
+	void followDrift(const SymbolMeasurement& measurement, const std::array<int, SECTION_COUNT>& levels)
+	{
+		if (DRIFT_ALPHA <= 0.0f || !measurement.ok) return;
+		for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+			cv::Vec3f& entry = m_palettes[section_index][levels[section_index]];
+			entry += (measurement.colors[section_index] - entry) * DRIFT_ALPHA;
+		}
+	}
+
+private:
+	static constexpr int CALIBRATION_SAMPLES = 5;
+	static constexpr int CALIBRATION_SAMPLE_SPACING = 2;
+	// added to every section's standard deviation, so a capture that happened to measure
+	// the same every time during calibration isn't trusted without limit
+	static constexpr float NOISE_FLOOR = 1.0f;
+	// weight of each followDrift colour, 0 disables it, around 0.05 follows slow lighting changes
+	static constexpr float DRIFT_ALPHA = 0.0f;
+
+	// false at the end of the video
+	bool readFrame(int frame_index, cv::Mat& frame)
+	{
+		// seeking is slow, grab through short gaps instead
+		if (frame_index < m_next_frame || frame_index - m_next_frame > 2 * m_config.symbol_frames) {
+			m_cap.set(cv::CAP_PROP_POS_FRAMES, frame_index);
+		}
+		else {
+			for (; m_next_frame < frame_index; ++m_next_frame) {
+				if (!m_cap.grab()) return false;
+			}
+		}
+		m_next_frame = frame_index + 1;
+		return m_cap.read(frame);
+	}
+
+	CaptureConfig m_config;
+	cv::VideoCapture m_cap{};
+	int m_next_frame = 0; // a freshly opened capture reads frame 0 first
+	cv::Mat m_frame{};
+	std::shared_ptr<const DecoderGeometry> m_geometry{};
+	std::array<std::array<cv::Vec3f, LEVEL_COUNT>, SECTION_COUNT> m_palettes{};
+	std::array<float, SECTION_COUNT> m_inv_two_variance{};
+	int m_errors = 0;
+};
+
+int main()
+{
+	std::string captures_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\captures.csv";
+
+	constexpr int DECODE_FRAMES = 246;
+	// symbols measured by every capture (in parallel) before they're combined and written out
+	constexpr int BATCH_SYMBOLS = 8;
+
+	std::vector<std::unique_ptr<CaptureDecoder>> captures{};
+	for (const auto& config : loadCaptures(captures_path)) {
+		captures.push_back(std::make_unique<CaptureDecoder>(config));
+	}
+	if (captures.empty()) {
+		throw std::runtime_error("No captures in " + captures_path);
+	}
+
+	cv::parallel_for_(cv::Range(0, (int)captures.size()), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; ++i) {
+			captures[i]->calibrate();
+		}
+		});
+
+	// one chunk per symbol, three characters each
+	ChunkedWriter text_output("combined_text.txt", "combined_text_chunks.csv");
+	int errors = 0;
+
+	// measurements[capture][symbol in batch]
+	std::vector<std::vector<SymbolMeasurement>> measurements(captures.size(), std::vector<SymbolMeasurement>(BATCH_SYMBOLS));
+	for (int batch_start = 0; batch_start < DECODE_FRAMES; batch_start += BATCH_SYMBOLS) {
+		const int batch_size = std::min(BATCH_SYMBOLS, DECODE_FRAMES - batch_start);
+		cv::parallel_for_(cv::Range(0, (int)captures.size()), [&](const cv::Range& range) {
+			for (int c = range.start; c < range.end; ++c) {
+				for (int i = 0; i < batch_size; ++i) {
+					measurements[c][i] = captures[c]->measure(batch_start + i);
+				}
+			}
+			});
+
+		for (int i = 0; i < batch_size; ++i) {
+			// the captures' noise is independent, so their log likelihoods add
+			std::array<std::array<float, LEVEL_COUNT>, SECTION_COUNT> costs{};
+			bool any = false;
+			for (size_t c = 0; c < captures.size(); ++c) {
+				const auto& m = measurements[c][i];
+				captures[c]->countErrors(m);
+				if (!m.ok) continue;
+				any = true;
+				for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+					for (int level = 0; level < LEVEL_COUNT; ++level) {
+						costs[section_index][level] += m.costs[section_index][level];
+					}
+				}
+			}
+
+			if (!any) {
+				// no capture has this symbol
+				text_output.writeChunk("???", 3);
+				errors += 3;
+				continue;
+			}
+
+			const auto levels = cheapestLevels(costs);
+			const auto decoded = decodeLevels(levels);
+			if (decoded.parity_errors == 0) {
+				for (size_t c = 0; c < captures.size(); ++c) {
+					captures[c]->followDrift(measurements[c][i], levels);
+				}
+			}
+			errors += decoded.parity_errors;
+			text_output.writeChunk(std::string_view(decoded.chars.data(), decoded.chars.size()), decoded.parity_errors);
+		}
+	}
+
+	for (const auto& capture : captures) {
+		std::cout << capture->name() << " errors on its own: " << capture->errors() << "\n";
+	}
+	std::cout << "Combined errors: " << errors << "\n";
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/opencv.hpp>
+
+// Calls callback with every pixel of an image_size image whose centre is inside quad
+inline void pixelsInQuad(
+	const std::array<cv::Point2f, 4>& quad,
+	cv::Size image_size,
+	const std::function<void(int x, int y)>& callback)
+{
+	float minX = quad[0].x, maxX = quad[0].x;
+	float minY = quad[0].y, maxY = quad[0].y;
+
+	for (int i = 1; i < 4; ++i) {
+		minX = std::min(minX, quad[i].x);
+		maxX = std::max(maxX, quad[i].x);
+		minY = std::min(minY, quad[i].y);
+		maxY = std::max(maxY, quad[i].y);
+	}
+
+	// Clamp to image boundaries
+	int x0 = std::max(0, (int)std::floor(minX));
+	int x1 = std::min(image_size.width - 1, (int)std::ceil(maxX));
+	int y0 = std::max(0, (int)std::floor(minY));
+	int y1 = std::min(image_size.height - 1, (int)std::ceil(maxY));
+
+	std::vector<cv::Point2f> polygon(quad.begin(), quad.end());
+
+	for (int y = y0; y <= y1; ++y) {
+		for (int x = x0; x <= x1; ++x) {
+			// Test pixel center
+			cv::Point2f p(x + 0.5f, y + 0.5f);
+			if (cv::pointPolygonTest(polygon, p, false) >= 0) {
+				callback(x, y);
+			}
+		}
+	}
+}
+
+// Maps frame pixels to where they'd be without lens distortion, see lens_model.h
+using UndistortFunction = std::function<std::vector<cv::Point2f>(const std::vector<cv::Point2f>&)>;
+
+// For each box, finds the frame pixels inside it that pass the mask (green channel 255).
+// Only depends on the geometry so is done once instead of on every frame.
+// H_inv maps frame coordinates to the mask's. With undistort, transformed_boxes are the distorted
+// corners and each pixel is undistorted before the mask lookup. Box edges are kept straight between
+// the distorted corners, the curve over a single box is well under a pixel.
+inline std::vector<std::vector<cv::Point>> computeBoxSamplePoints(
+	const std::vector<std::array<cv::Point2f, 4>>& transformed_boxes,
+	const cv::Mat& mask,
+	const cv::Mat& H_inv,
+	cv::Size frame_size,
+	const UndistortFunction& undistort = {})
+{
+	std::vector<std::vector<cv::Point>> sample_points{};
+	for (const auto& box : transformed_boxes) {
+		std::vector<cv::Point2f> candidates{};
+		pixelsInQuad(box, frame_size, [&](int x, int y) {
+			candidates.push_back(cv::Point2f(x, y));
+			});
+
+		std::vector<cv::Point2f> mask_coords{};
+		if (!candidates.empty()) {
+			cv::perspectiveTransform(undistort ? undistort(candidates) : candidates, mask_coords, H_inv);
+		}
+
+		auto& points = sample_points.emplace_back();
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			int mx = (int)roundf(mask_coords[i].x);
+			int my = (int)roundf(mask_coords[i].y);
+			// pixels at the edge of the box can map just off the screen, undistorted or not
+			if (mx < 0 || my < 0 || mx >= mask.cols || my >= mask.rows) continue;
+			if (mask.at<cv::Vec3b>(my, mx)[1] == 255) {
+				points.push_back(cv::Point((int)candidates[i].x, (int)candidates[i].y));
+			}
+		}
+	}
+	return sample_points;
+}
+
+// Sum of the sampled pixels of a box
+inline cv::Vec3i sumBoxPixels(const cv::Mat& frame, const std::vector<cv::Point>& points) {
+	cv::Vec3i sum{};
+	for (const cv::Point& p : points) {
+		const cv::Vec3b& col = frame.ptr<cv::Vec3b>(p.y)[p.x];
+		sum[0] += col[0];
+		sum[1] += col[1];
+		sum[2] += col[2];
+	}
+	return sum;
+}
+
+// Average colour of each box in a frame
+inline std::vector<cv::Vec3f> sampleBoxes(const cv::Mat& frame, const std::vector<std::vector<cv::Point>>& box_sample_points) {
+	std::vector<cv::Vec3f> res(box_sample_points.size());
+	for (std::size_t box_index = 0; box_index < box_sample_points.size(); ++box_index) {
+		const auto& points = box_sample_points[box_index];
+		if (points.empty()) continue;
+		const cv::Vec3i sum = sumBoxPixels(frame, points);
+		res[box_index] = cv::Vec3f((float)sum[0] / points.size(), (float)sum[1] / points.size(), (float)sum[2] / points.size());
+	}
+	return res;
+}
+
+// sampleBoxes rounded to the nearest whole colour, halves rounding up
+inline std::vector<cv::Vec3b> sampleBoxesRounded(const cv::Mat& frame, const std::vector<std::vector<cv::Point>>& box_sample_points) {
+	std::vector<cv::Vec3b> res(box_sample_points.size());
+	for (std::size_t box_index = 0; box_index < box_sample_points.size(); ++box_index) {
+		const int n = (int)box_sample_points[box_index].size();
+		if (n == 0) continue;
+		const cv::Vec3i sum = sumBoxPixels(frame, box_sample_points[box_index]);
+		res[box_index][0] = static_cast<uchar>((sum[0] + n / 2) / n);
+		res[box_index][1] = static_cast<uchar>((sum[1] + n / 2) / n);
+		res[box_index][2] = static_cast<uchar>((sum[2] + n / 2) / n);
+	}
+	return res;
+}
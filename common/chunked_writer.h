@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <filesystem>
+#include <format>
+#include <stdexcept>
+#include <cstdint>
+
+// crc continues a checksum of earlier data, so it can be computed piece by piece
+inline uint32_t crc32(std::string_view data, uint32_t crc = 0) {
+	crc = ~crc;
+	for (const char c : data) {
+		crc ^= static_cast<uint8_t>(c);
+		for (int k = 0; k < 8; ++k) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+// Writes output as soon as each chunk is decoded instead of at the end of the run.
+// Every chunk is flushed along with a line in a sidecar csv (offset, length, crc32,
+// parity errors) so downstream consumers can check and use it straight away.
+// Both files are binary so the offsets are bytes on every platform.
+class ChunkedWriter {
+public:
+	// where the writer is up to, so a later run can carry on from there
+	struct Position {
+		size_t offset = 0;        // bytes in the output
+		size_t chunks_offset = 0; // bytes in the sidecar csv
+		int chunk_index = 0;
+	};
+
+	ChunkedWriter(const std::string& path, const std::string& chunks_path)
+	{
+		m_out.open(path, std::ios::binary);
+		m_chunks.open(chunks_path, std::ios::binary);
+		if (!m_out || !m_chunks) {
+			throw std::runtime_error("Failed to create file for writing");
+		}
+		writeChunksLine("chunk,offset,length,crc32,parity_errors\n");
+	}
+
+	// Carries on from a position saved by an earlier run, anything written after it is discarded
+	ChunkedWriter(const std::string& path, const std::string& chunks_path, const Position& resume_from)
+		: m_offset(resume_from.offset), m_chunks_offset(resume_from.chunks_offset), m_chunk_index(resume_from.chunk_index)
+	{
+		std::filesystem::resize_file(path, resume_from.offset);
+		std::filesystem::resize_file(chunks_path, resume_from.chunks_offset);
+		m_out.open(path, std::ios::binary | std::ios::app);
+		m_chunks.open(chunks_path, std::ios::binary | std::ios::app);
+		if (!m_out || !m_chunks) {
+			throw std::runtime_error("Failed to open file for appending");
+		}
+	}
+
+	// data that isn't part of any chunk, e.g. a file header
+	void writeHeader(std::string_view data)
+	{
+		m_out.write(data.data(), data.size());
+		m_offset += data.size();
+	}
+
+	// parity_errors is -1 when the data carries no parity
+	void writeChunk(std::string_view data, int parity_errors = -1)
+	{
+		m_out.write(data.data(), data.size());
+		m_out.flush();
+		writeChunksLine(std::format("{},{},{},{:x},{}\n", m_chunk_index, m_offset, data.size(), crc32(data), parity_errors));
+		m_offset += data.size();
+		++m_chunk_index;
+	}
+
+	Position position() const
+	{
+		return { m_offset, m_chunks_offset, m_chunk_index };
+	}
+
+private:
+	void writeChunksLine(std::string_view line)
+	{
+		m_chunks.write(line.data(), line.size());
+		m_chunks.flush();
+		m_chunks_offset += line.size();
+	}
+
+	std::ofstream m_out{};
+	std::ofstream m_chunks{};
+	size_t m_offset = 0;
+	size_t m_chunks_offset = 0;
+	int m_chunk_index = 0;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <span>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+#include "palette_tracker.h"
+
+// Computes squared Euclidean distance between two BGR colors
+inline int colorDistanceSq(const cv::Vec3b& a, const cv::Vec3b& b)
+{
+	int db = int(a[0]) - int(b[0]);
+	int dg = int(a[1]) - int(b[1]);
+	int dr = int(a[2]) - int(b[2]);
+	return db * db + dg * dg + dr * dr;
+}
+
+// Finds closest color from a list
+// Specialised on palette size so the loop can be unrolled and vectorised
+template <size_t N>
+PaletteMatch findClosestMatch(const cv::Vec3b& inputColor, std::span<const cv::Vec3b, N> palette)
+{
+	PaletteMatch match{};
+
+	for (int i = 0; i < (int)palette.size(); i++)
+	{
+		int dist = colorDistanceSq(inputColor, palette[i]);
+		if (dist < match.dist)
+		{
+			match.second_dist = match.dist;
+			match.second_index = match.index;
+			match.dist = dist;
+			match.index = i;
+		}
+		else if (dist < match.second_dist)
+		{
+			match.second_dist = dist;
+			match.second_index = i;
+		}
+	}
+
+	return match;
+}
+
+// Picks the fixed-size kernel for the palette sizes we use (8 levels, 128 or 512 colours)
+inline PaletteMatch findClosestMatch(const cv::Vec3b& inputColor, std::span<const cv::Vec3b> palette)
+{
+	switch (palette.size()) {
+	case 8:
+		return findClosestMatch(inputColor, palette.first<8>());
+	case 128:
+		return findClosestMatch(inputColor, palette.first<128>());
+	case 512:
+		return findClosestMatch(inputColor, palette.first<512>());
+	default:
+		return findClosestMatch<std::dynamic_extent>(inputColor, palette);
+	}
+}
+
+// findClosestMatch for palettes that must not be empty
+inline PaletteMatch lookupMatchFromColor(std::span<const cv::Vec3b> palette, cv::Vec3b color)
+{
+	PaletteMatch match = findClosestMatch(color, palette);
+	if (match.index < 0) {
+		throw std::runtime_error("Couldn't find best index");
+	}
+	return match;
+}
+
+inline int lookupIndexFromColor(std::span<const cv::Vec3b> palette, cv::Vec3b color)
+{
+	return lookupMatchFromColor(palette, color).index;  // index of the closest matching color
+}
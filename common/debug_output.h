@@ -0,0 +1,107 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <filesystem>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+// Renders debug images (overlays, decoded images) on a background thread and writes them
+// to a directory as PNGs, or appends them to a video if the path ends in .avi or .mp4.
+// Until open() is called it's disabled and never runs the render functions.
+// submit() never blocks: when the renderer falls behind, new images are dropped.
+class DebugOutput {
+public:
+	DebugOutput() = default;
+
+	DebugOutput(const DebugOutput&) = delete;
+	DebugOutput& operator=(const DebugOutput&) = delete;
+
+	~DebugOutput()
+	{
+		if (!m_thread.joinable()) return;
+		{
+			std::lock_guard lock(m_mutex);
+			m_closed = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+	void open(const std::string& path, size_t max_pending = 16)
+	{
+		if (enabled()) {
+			throw std::runtime_error("Debug output is already open");
+		}
+		m_path = path;
+		m_max_pending = max_pending;
+		m_video = path.ends_with(".avi") || path.ends_with(".mp4");
+		if (!m_video) {
+			std::filesystem::create_directories(path);
+		}
+		m_thread = std::thread([this] { run(); });
+	}
+
+	bool enabled() const { return m_thread.joinable(); }
+
+	void submit(std::string name, std::function<cv::Mat()> render)
+	{
+		if (!enabled()) return;
+		{
+			std::lock_guard lock(m_mutex);
+			if (m_jobs.size() >= m_max_pending) {
+				return;
+			}
+			m_jobs.emplace_back(std::move(name), std::move(render));
+		}
+		m_cv.notify_one();
+	}
+
+private:
+	void run()
+	{
+		cv::VideoWriter writer{};
+		while (true) {
+			std::pair<std::string, std::function<cv::Mat()>> job;
+			{
+				std::unique_lock lock(m_mutex);
+				m_cv.wait(lock, [&] { return !m_jobs.empty() || m_closed; });
+				if (m_jobs.empty()) break;
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+
+			cv::Mat img = job.second();
+			if (img.empty()) continue;
+
+			if (!m_video) {
+				cv::imwrite((std::filesystem::path(m_path) / (job.first + ".png")).string(), img);
+				continue;
+			}
+			if (!writer.isOpened()) {
+				int fourcc = m_path.ends_with(".avi") ? cv::VideoWriter::fourcc('M', 'J', 'P', 'G') : cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+				m_video_size = img.size();
+				writer.open(m_path, fourcc, 2.0, m_video_size);
+			}
+			if (img.size() != m_video_size) {
+				cv::resize(img, img, m_video_size, 0, 0, cv::INTER_NEAREST);
+			}
+			writer.write(img);
+		}
+	}
+
+	std::string m_path{};
+	size_t m_max_pending = 0;
+	bool m_video = false;
+	cv::Size m_video_size{};
+	std::thread m_thread{};
+	std::mutex m_mutex{};
+	std::condition_variable m_cv{};
+	std::deque<std::pair<std::string, std::function<cv::Mat()>>> m_jobs{};
+	bool m_closed = false;
+};
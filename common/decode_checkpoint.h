@@ -0,0 +1,135 @@
+#pragma once
+
+#include <string>
+#include <array>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+#include "chunked_writer.h"
+#include "section_layout.h"
+
+// Decoder state saved every few symbols so an interrupted decode can carry on where it stopped
+// instead of starting again from calibration.
+struct DecodeCheckpoint {
+	std::string identity; // capture and settings it was saved for, see text_decoder2's checkpoint_identity
+	int next_symbol = 0;
+	int errors = 0;
+	int corrected = 0;
+	int lost_symbols = 0;
+	ChunkedWriter::Position output{};
+	std::array<std::array<cv::Vec3b, LEVEL_COUNT>, SECTION_COUNT> palettes{}; // includes any tracked drift
+	std::array<float, BOX_COUNT> box_weights{};
+	int sample_level = 0;
+	std::array<std::array<cv::Matx33f, LEVEL_COUNT>, SECTION_COUNT> covariances{};
+};
+
+inline void saveCheckpoint(const std::string& path, const DecodeCheckpoint& checkpoint) {
+	// written next to the old one and renamed over it, so there's always a complete checkpoint on disk
+	const std::string tmp_path = path + ".tmp";
+	{
+		std::ofstream file(tmp_path);
+		if (!file) {
+			throw std::runtime_error("Failed to create file for writing");
+		}
+		file << "identity " << checkpoint.identity << "\n";
+		file << "next_symbol " << checkpoint.next_symbol << "\n";
+		file << "errors " << checkpoint.errors << "\n";
+		file << "corrected " << checkpoint.corrected << "\n";
+		file << "lost_symbols " << checkpoint.lost_symbols << "\n";
+		file << "output " << checkpoint.output.offset << " " << checkpoint.output.chunks_offset << " " << checkpoint.output.chunk_index << "\n";
+		for (const auto& palette : checkpoint.palettes) {
+			file << "palette";
+			for (const auto& color : palette) {
+				file << " " << (int)color[0] << " " << (int)color[1] << " " << (int)color[2];
+			}
+			file << "\n";
+		}
+		file << "weights";
+		for (const float weight : checkpoint.box_weights) {
+			file << " " << weight;
+		}
+		file << "\n";
+		file << "sample_level " << checkpoint.sample_level << "\n";
+		for (const auto& section_covariances : checkpoint.covariances) {
+			file << "covariance";
+			for (const auto& cov : section_covariances) {
+				for (int i = 0; i < 9; ++i) {
+					file << " " << cov.val[i];
+				}
+			}
+			file << "\n";
+		}
+	}
+	std::filesystem::rename(tmp_path, path);
+}
+
+inline DecodeCheckpoint loadCheckpoint(const std::string& path) {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + path);
+	}
+
+	DecodeCheckpoint checkpoint{};
+	checkpoint.box_weights.fill(1.0f);
+	for (auto& section_covariances : checkpoint.covariances) {
+		section_covariances.fill(cv::Matx33f::eye());
+	}
+	std::string key;
+	int section_index = 0;
+	int covariance_section_index = 0;
+	while (file >> key) {
+		if (key == "identity") {
+			file >> std::ws;
+			std::getline(file, checkpoint.identity);
+		}
+		else if (key == "next_symbol") {
+			file >> checkpoint.next_symbol;
+		}
+		else if (key == "errors") {
+			file >> checkpoint.errors;
+		}
+		else if (key == "corrected") {
+			file >> checkpoint.corrected;
+		}
+		else if (key == "lost_symbols") {
+			file >> checkpoint.lost_symbols;
+		}
+		else if (key == "output") {
+			file >> checkpoint.output.offset >> checkpoint.output.chunks_offset >> checkpoint.output.chunk_index;
+		}
+		else if (key == "palette" && section_index < SECTION_COUNT) {
+			for (auto& color : checkpoint.palettes[section_index]) {
+				int b{}, g{}, r{};
+				file >> b >> g >> r;
+				color = cv::Vec3b((uchar)b, (uchar)g, (uchar)r);
+			}
+			++section_index;
+		}
+		else if (key == "weights") {
+			for (float& weight : checkpoint.box_weights) {
+				file >> weight;
+			}
+		}
+		else if (key == "sample_level") {
+			file >> checkpoint.sample_level;
+		}
+		else if (key == "covariance" && covariance_section_index < SECTION_COUNT) {
+			for (auto& cov : checkpoint.covariances[covariance_section_index]) {
+				for (int i = 0; i < 9; ++i) {
+					file >> cov.val[i];
+				}
+			}
+			++covariance_section_index;
+		}
+		else {
+			throw std::runtime_error("Unexpected '" + key + "' in checkpoint " + path);
+		}
+	}
+	if (!file.eof() || section_index != SECTION_COUNT) {
+		throw std::runtime_error("Checkpoint is incomplete: " + path);
+	}
+	return checkpoint;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Covariance of each palette entry, from its calibration samples (one section colour per calibration frame).
+// A handful of samples is a noisy estimate, so each entry is shrunk towards the covariance pooled over the
+// whole palette, weighted as prior_samples extra samples. noise_floor is added to every channel's standard
+// deviation so an entry that happened to measure the same every time still has some spread.
+template <std::size_t N>
+std::array<cv::Matx33f, N> estimateEntryCovariances(const std::array<std::vector<cv::Vec3f>, N>& samples, float prior_samples, float noise_floor) {
+	std::array<cv::Matx33f, N> scatter{};
+	std::array<int, N> dof{};
+	cv::Matx33f pooled{};
+	int pooled_dof = 0;
+	for (std::size_t i = 0; i < N; ++i) {
+		if (samples[i].size() < 2) continue;
+		cv::Vec3f mean{};
+		for (const auto& c : samples[i]) {
+			mean += c;
+		}
+		mean *= 1.0 / samples[i].size();
+		for (const auto& c : samples[i]) {
+			const cv::Vec3f d = c - mean;
+			for (int r = 0; r < 3; ++r) {
+				for (int col = 0; col < 3; ++col) {
+					scatter[i](r, col) += d[r] * d[col];
+				}
+			}
+		}
+		dof[i] = (int)samples[i].size() - 1;
+		pooled += scatter[i];
+		pooled_dof += dof[i];
+	}
+	if (pooled_dof > 0) {
+		pooled = pooled * (1.0 / pooled_dof);
+	}
+
+	std::array<cv::Matx33f, N> res{};
+	for (std::size_t i = 0; i < N; ++i) {
+		const float weight = dof[i] + prior_samples;
+		res[i] = weight > 0.0f ? (scatter[i] + pooled * prior_samples) * (1.0 / weight) : pooled;
+		for (int c = 0; c < 3; ++c) {
+			res[i](c, c) += noise_floor * noise_floor;
+		}
+	}
+	return res;
+}
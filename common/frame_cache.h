@@ -0,0 +1,215 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <opencv2/opencv.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Cache of raw BGR frames cropped to the region covered by the boxes.
+// Built once by the framecache tool, then memory mapped by the other tools so
+// that repeated runs skip PNG/video decoding entirely.
+//
+// Layout: FrameCacheHeader, frame_count int32 frame numbers, padding up to
+// data_offset, then frame_count frames of roi_height * roi_width * 3 bytes.
+
+constexpr char FRAME_CACHE_MAGIC[4] = { 'R', 'O', 'I', 'C' };
+constexpr uint32_t FRAME_CACHE_VERSION = 1;
+constexpr uint32_t FRAME_CACHE_ALIGNMENT = 4096;
+
+struct FrameCacheHeader {
+	char magic[4];
+	uint32_t version;
+	int32_t roi_x;
+	int32_t roi_y;
+	int32_t roi_width;
+	int32_t roi_height;
+	uint32_t frame_count;
+	uint32_t data_offset;
+};
+
+// Writes a frame cache one frame at a time, so the source frames never all need to be in memory
+class FrameCacheWriter {
+public:
+	FrameCacheWriter(const std::string& path, cv::Rect roi, const std::vector<int>& frame_numbers)
+		: m_path(path), m_roi(roi), m_remaining(frame_numbers.size())
+	{
+		FrameCacheHeader header{};
+		std::memcpy(header.magic, FRAME_CACHE_MAGIC, sizeof(header.magic));
+		header.version = FRAME_CACHE_VERSION;
+		header.roi_x = roi.x;
+		header.roi_y = roi.y;
+		header.roi_width = roi.width;
+		header.roi_height = roi.height;
+		header.frame_count = (uint32_t)frame_numbers.size();
+		size_t index_end = sizeof(header) + frame_numbers.size() * sizeof(int32_t);
+		header.data_offset = (uint32_t)((index_end + FRAME_CACHE_ALIGNMENT - 1) / FRAME_CACHE_ALIGNMENT * FRAME_CACHE_ALIGNMENT);
+
+		m_file.open(path, std::ios::binary);
+		if (!m_file) {
+			throw std::runtime_error("Failed to create file for writing");
+		}
+		m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		for (const int n : frame_numbers) {
+			int32_t v = n;
+			m_file.write(reinterpret_cast<const char*>(&v), sizeof(v));
+		}
+		std::vector<char> padding(header.data_offset - index_end, 0);
+		m_file.write(padding.data(), padding.size());
+	}
+
+	// Frames must be appended in the order of frame_numbers
+	void append(const cv::Mat& frame)
+	{
+		if (m_remaining == 0) {
+			throw std::runtime_error("More frames appended than the cache was created for");
+		}
+		cv::Mat cropped = frame(m_roi);
+		for (int y = 0; y < cropped.rows; ++y) {
+			m_file.write(reinterpret_cast<const char*>(cropped.ptr<cv::Vec3b>(y)), (std::streamsize)m_roi.width * 3);
+		}
+		if (!m_file) {
+			throw std::runtime_error("Failed to write frame cache: " + m_path);
+		}
+		--m_remaining;
+	}
+
+private:
+	std::string m_path;
+	cv::Rect m_roi;
+	size_t m_remaining;
+	std::ofstream m_file{};
+};
+
+// Read-only memory mapping of a frame cache. Frames are returned as cv::Mat headers
+// pointing into the mapping, so nothing is copied or decoded.
+class FrameCache {
+public:
+	FrameCache() = default;
+
+	explicit FrameCache(const std::string& path)
+	{
+		open(path);
+	}
+
+	FrameCache(const FrameCache&) = delete;
+	FrameCache& operator=(const FrameCache&) = delete;
+
+	~FrameCache()
+	{
+		close();
+	}
+
+	void open(const std::string& path)
+	{
+		close();
+#ifdef _WIN32
+		m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("Could not open file: " + path);
+		}
+		LARGE_INTEGER size{};
+		GetFileSizeEx(m_file, &size);
+		m_size = (size_t)size.QuadPart;
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		m_data = m_mapping ? static_cast<const uchar*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+		m_fd = ::open(path.c_str(), O_RDONLY);
+		if (m_fd < 0) {
+			throw std::runtime_error("Could not open file: " + path);
+		}
+		struct stat st {};
+		fstat(m_fd, &st);
+		m_size = (size_t)st.st_size;
+		void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+		m_data = (data == MAP_FAILED) ? nullptr : static_cast<const uchar*>(data);
+#endif
+		if (!m_data) {
+			close();
+			throw std::runtime_error("Failed to map frame cache: " + path);
+		}
+
+		if (m_size < sizeof(FrameCacheHeader)) {
+			close();
+			throw std::runtime_error("Frame cache is truncated: " + path);
+		}
+		std::memcpy(&m_header, m_data, sizeof(m_header));
+		const size_t frame_bytes = (size_t)m_header.roi_width * m_header.roi_height * 3;
+		if (std::memcmp(m_header.magic, FRAME_CACHE_MAGIC, sizeof(m_header.magic)) != 0 || m_header.version != FRAME_CACHE_VERSION) {
+			close();
+			throw std::runtime_error("Not a frame cache: " + path);
+		}
+		if (m_size < m_header.data_offset + frame_bytes * m_header.frame_count) {
+			close();
+			throw std::runtime_error("Frame cache is truncated: " + path);
+		}
+
+		m_frame_numbers.resize(m_header.frame_count);
+		std::memcpy(m_frame_numbers.data(), m_data + sizeof(m_header), m_frame_numbers.size() * sizeof(int32_t));
+	}
+
+	bool isOpen() const { return m_data != nullptr; }
+
+	// Region of the original frame that was cached; cached frames have its size and
+	// pixel (0, 0) corresponds to roi().tl() in the original frame
+	cv::Rect roi() const { return cv::Rect(m_header.roi_x, m_header.roi_y, m_header.roi_width, m_header.roi_height); }
+
+	const std::vector<int32_t>& frameNumbers() const { return m_frame_numbers; }
+
+	// Returns false if the frame isn't in the cache
+	bool frame(int frame_number, cv::Mat& frame) const
+	{
+		auto it = std::find(m_frame_numbers.begin(), m_frame_numbers.end(), frame_number);
+		if (it == m_frame_numbers.end()) {
+			return false;
+		}
+		const size_t frame_bytes = (size_t)m_header.roi_width * m_header.roi_height * 3;
+		const uchar* data = m_data + m_header.data_offset + frame_bytes * (size_t)(it - m_frame_numbers.begin());
+		// read-only view, callers must not write to it
+		frame = cv::Mat(m_header.roi_height, m_header.roi_width, CV_8UC3, const_cast<uchar*>(data));
+		return true;
+	}
+
+private:
+	void close()
+	{
+#ifdef _WIN32
+		if (m_data) UnmapViewOfFile(m_data);
+		if (m_mapping) CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+		m_mapping = nullptr;
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_data) munmap(const_cast<uchar*>(m_data), m_size);
+		if (m_fd >= 0) ::close(m_fd);
+		m_fd = -1;
+#endif
+		m_data = nullptr;
+		m_size = 0;
+		m_frame_numbers.clear();
+	}
+
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#else
+	int m_fd = -1;
+#endif
+	const uchar* m_data = nullptr;
+	size_t m_size = 0;
+	FrameCacheHeader m_header{};
+	std::vector<int32_t> m_frame_numbers{};
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+// Camera intrinsics and distortion coefficients, as written by OpenCV's camera calibration
+// sample from a checkerboard capture (camera_matrix, distortion_coefficients)
+struct LensModel {
+	cv::Mat camera_matrix{};
+	cv::Mat dist_coeffs{};
+
+	bool enabled() const { return !camera_matrix.empty(); }
+};
+
+inline LensModel loadLensModel(const std::string& path) {
+	cv::FileStorage fs(path, cv::FileStorage::READ);
+	if (!fs.isOpened()) {
+		throw std::runtime_error("Could not open file: " + path);
+	}
+
+	LensModel lens{};
+	fs["camera_matrix"] >> lens.camera_matrix;
+	fs["distortion_coefficients"] >> lens.dist_coeffs;
+	if (lens.camera_matrix.empty() || lens.dist_coeffs.empty()) {
+		throw std::runtime_error("No camera_matrix or distortion_coefficients in " + path);
+	}
+	return lens;
+}
+
+// Estimates a lens model from a directory of captures of a checkerboard held at different
+// positions and angles. board_size is the number of inner corners.
+inline LensModel estimateLensModel(const std::filesystem::path& images_dir, cv::Size board_size) {
+	std::vector<cv::Point3f> board_points{};
+	for (int y = 0; y < board_size.height; ++y) {
+		for (int x = 0; x < board_size.width; ++x) {
+			board_points.push_back(cv::Point3f((float)x, (float)y, 0.0f));
+		}
+	}
+
+	std::vector<std::vector<cv::Point3f>> object_points{};
+	std::vector<std::vector<cv::Point2f>> image_points{};
+	cv::Size image_size{};
+	for (const auto& entry : std::filesystem::directory_iterator(images_dir)) {
+		cv::Mat img = cv::imread(entry.path().string());
+		if (img.empty()) continue;
+
+		cv::Mat gray;
+		cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+		std::vector<cv::Point2f> corners{};
+		if (!cv::findChessboardCorners(gray, board_size, corners, cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE)) {
+			continue;
+		}
+		cv::cornerSubPix(gray, corners, cv::Size(11, 11), cv::Size(-1, -1), cv::TermCriteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 30, 0.01));
+
+		object_points.push_back(board_points);
+		image_points.push_back(corners);
+		image_size = img.size();
+	}
+	if (image_points.size() < 3) {
+		throw std::runtime_error("Found the checkerboard in too few images in " + images_dir.string());
+	}
+
+	LensModel lens{};
+	std::vector<cv::Mat> rvecs{}, tvecs{};
+	double rms = cv::calibrateCamera(object_points, image_points, image_size, lens.camera_matrix, lens.dist_coeffs, rvecs, tvecs);
+	std::cout << "Lens model from " << image_points.size() << " checkerboard images, reprojection error " << rms << "\n";
+	return lens;
+}
+
+inline void saveLensModel(const std::string& path, const LensModel& lens) {
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	if (!fs.isOpened()) {
+		throw std::runtime_error("Failed to create file for writing");
+	}
+	fs << "camera_matrix" << lens.camera_matrix;
+	fs << "distortion_coefficients" << lens.dist_coeffs;
+}
+
+// captured (distorted) pixel coordinates -> where they would be with an ideal lens
+inline std::vector<cv::Point2f> undistortPoints(const std::vector<cv::Point2f>& points, const LensModel& lens) {
+	std::vector<cv::Point2f> res{};
+	cv::undistortPoints(points, res, lens.camera_matrix, lens.dist_coeffs, cv::noArray(), lens.camera_matrix);
+	return res;
+}
+
+// ideal lens pixel coordinates -> where they are in the captured frame
+inline std::vector<cv::Point2f> distortPoints(const std::vector<cv::Point2f>& points, const LensModel& lens) {
+	const double fx = lens.camera_matrix.at<double>(0, 0);
+	const double fy = lens.camera_matrix.at<double>(1, 1);
+	const double cx = lens.camera_matrix.at<double>(0, 2);
+	const double cy = lens.camera_matrix.at<double>(1, 2);
+
+	std::vector<cv::Point3f> rays{};
+	for (const auto& p : points) {
+		rays.push_back(cv::Point3f((float)((p.x - cx) / fx), (float)((p.y - cy) / fy), 1.0f));
+	}
+
+	std::vector<cv::Point2f> res{};
+	cv::projectPoints(rays, cv::Vec3d(0, 0, 0), cv::Vec3d(0, 0, 0), lens.camera_matrix, lens.dist_coeffs, res);
+	return res;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <limits>
+
+#include <opencv2/opencv.hpp>
+
+struct PaletteMatch {
+	int index = -1;
+	// squared distances (Euclidean, or in units of the noise when classified by it), only their ratio is compared
+	float dist = std::numeric_limits<float>::max();        // to the closest entry
+	float second_dist = std::numeric_limits<float>::max(); // to the runner up
+	int second_index = -1;
+};
+
+// Follows slow drift of a calibrated palette (ambient light, camera auto exposure) over a long decode.
+// Colours that are classified confidently pull their palette entry towards them with an
+// exponential moving average, so each update is O(1) and no recalibration pass is needed.
+template <std::size_t N>
+class PaletteTracker {
+public:
+	// alpha: weight of each new colour, 0 disables tracking
+	// max_distance_ratio: only colours this much closer to their entry than to the runner up are trusted
+	PaletteTracker(std::array<cv::Vec3b, N>& palette, float alpha, float max_distance_ratio)
+		: m_palette(&palette), m_alpha(alpha), m_max_dist_ratio_sq(max_distance_ratio * max_distance_ratio)
+	{
+		for (std::size_t i = 0; i < N; ++i) {
+			m_ema[i] = cv::Vec3f((*m_palette)[i][0], (*m_palette)[i][1], (*m_palette)[i][2]);
+		}
+	}
+
+	void update(const PaletteMatch& match, const cv::Vec3b& color)
+	{
+		if (m_alpha <= 0.0f || match.index < 0) return;
+		if ((float)match.dist > m_max_dist_ratio_sq * (float)match.second_dist) return;
+
+		cv::Vec3f& ema = m_ema[match.index];
+		cv::Vec3b& entry = (*m_palette)[match.index];
+		for (int c = 0; c < 3; ++c) {
+			ema[c] += m_alpha * ((float)color[c] - ema[c]);
+			entry[c] = cv::saturate_cast<uchar>(ema[c]);
+		}
+	}
+
+private:
+	std::array<cv::Vec3b, N>* m_palette;
+	std::array<cv::Vec3f, N> m_ema{};
+	float m_alpha;
+	float m_max_dist_ratio_sq;
+};
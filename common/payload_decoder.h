@@ -0,0 +1,192 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <format>
+#include <cstdint>
+
+#include "chunked_writer.h"
+
+// Framed, compressed payload carried over the 7 bit character channel. The characters' bits
+// (7 per character, most significant first) form a byte stream of, little endian:
+//   u32 compressed size | u32 original size | LZ4 block (compressed size bytes) | u32 crc32 of the original
+// The LZ4 block is decompressed as the characters arrive, so text comes out frame by frame.
+class PayloadDecoder {
+public:
+	// returns the text decompressed from this character, usually nothing or a few bytes
+	std::string push(char c)
+	{
+		std::string out{};
+		m_bits = ((m_bits << 7) | (static_cast<uint8_t>(c) & 0x7F)) & 0x7FFF;
+		m_bit_count += 7;
+		while (m_bit_count >= 8) {
+			m_bit_count -= 8;
+			pushByte(static_cast<uint8_t>(m_bits >> m_bit_count), out);
+		}
+		return out;
+	}
+
+	bool done() const { return m_state == State::Done || m_state == State::Failed; }
+	bool valid() const { return m_state == State::Done && m_error.empty(); }
+	// why the payload is invalid, or where decoding got up to
+	std::string status() const
+	{
+		if (!m_error.empty()) return m_error;
+		if (m_state == State::Done) return std::format("ok, {} bytes", m_produced);
+		return std::format("incomplete, {} of {} bytes", m_produced, m_original_size);
+	}
+
+private:
+	enum class State { Header, Body, Checksum, Done, Failed };
+	// position within an LZ4 sequence
+	enum class Lz4State { Token, LiteralLength, Literals, OffsetLow, OffsetHigh, MatchLength };
+
+	static constexpr size_t WINDOW_SIZE = 65536;
+
+	void fail(const std::string& error)
+	{
+		m_error = error;
+		m_state = State::Failed;
+	}
+
+	void pushByte(uint8_t byte, std::string& out)
+	{
+		switch (m_state) {
+		case State::Header:
+			m_field |= uint64_t(byte) << (8 * m_field_bytes);
+			if (++m_field_bytes == 8) {
+				m_compressed_size = uint32_t(m_field);
+				m_original_size = uint32_t(m_field >> 32);
+				m_field = 0;
+				m_field_bytes = 0;
+				if (m_compressed_size == 0 && m_original_size > 0) {
+					// nothing to decompress the original from, don't let the checksum of nothing pass
+					fail(std::format("no compressed data for {} bytes", m_original_size));
+				}
+				else {
+					m_state = m_compressed_size > 0 ? State::Body : State::Checksum;
+				}
+			}
+			break;
+		case State::Body:
+			pushLz4(byte, out);
+			if (m_state == State::Body && ++m_consumed == m_compressed_size) {
+				// the last sequence is only literals, so the block has to end after them
+				if (!(m_lz4_state == Lz4State::OffsetLow && m_literal_length == 0)) {
+					fail("LZ4 block ends mid sequence");
+				}
+				else if (m_produced != m_original_size) {
+					fail(std::format("decompressed {} bytes, expected {}", m_produced, m_original_size));
+				}
+				else {
+					m_state = State::Checksum;
+				}
+			}
+			break;
+		case State::Checksum:
+			m_field |= uint64_t(byte) << (8 * m_field_bytes);
+			if (++m_field_bytes == 4) {
+				if (uint32_t(m_field) != m_crc) {
+					fail("crc32 mismatch");
+				}
+				else {
+					m_state = State::Done;
+				}
+			}
+			break;
+		case State::Done:
+		case State::Failed:
+			break;
+		}
+	}
+
+	void pushLz4(uint8_t byte, std::string& out)
+	{
+		switch (m_lz4_state) {
+		case Lz4State::Token:
+			m_literal_length = byte >> 4;
+			m_match_length = byte & 0x0F;
+			m_lz4_state = m_literal_length == 15 ? Lz4State::LiteralLength : m_literal_length > 0 ? Lz4State::Literals : Lz4State::OffsetLow;
+			break;
+		case Lz4State::LiteralLength:
+			m_literal_length += byte;
+			if (byte != 255) {
+				m_lz4_state = Lz4State::Literals;
+			}
+			break;
+		case Lz4State::Literals:
+			emit(static_cast<char>(byte), out);
+			if (--m_literal_length == 0) {
+				m_lz4_state = Lz4State::OffsetLow;
+			}
+			break;
+		case Lz4State::OffsetLow:
+			m_offset = byte;
+			m_lz4_state = Lz4State::OffsetHigh;
+			break;
+		case Lz4State::OffsetHigh:
+			m_offset |= size_t(byte) << 8;
+			if (m_offset == 0 || m_offset > m_window.size()) {
+				fail("LZ4 match offset outside the decoded data");
+				return;
+			}
+			m_match_length += 4;
+			if (m_match_length == 15 + 4) {
+				m_lz4_state = Lz4State::MatchLength;
+			}
+			else {
+				copyMatch(out);
+			}
+			break;
+		case Lz4State::MatchLength:
+			m_match_length += byte;
+			if (byte != 255) {
+				copyMatch(out);
+			}
+			break;
+		}
+	}
+
+	void copyMatch(std::string& out)
+	{
+		// byte by byte, the match may overlap what it's producing
+		for (size_t i = 0; i < m_match_length; ++i) {
+			emit(m_window[m_window.size() - m_offset], out);
+		}
+		m_lz4_state = Lz4State::Token;
+	}
+
+	void emit(char c, std::string& out)
+	{
+		if (m_produced == m_original_size) {
+			fail("payload is longer than its header says");
+			return;
+		}
+		out.push_back(c);
+		m_crc = crc32(std::string_view(&c, 1), m_crc);
+		++m_produced;
+		m_window.push_back(c);
+		if (m_window.size() > 2 * WINDOW_SIZE) {
+			m_window.erase(0, m_window.size() - WINDOW_SIZE);
+		}
+	}
+
+	State m_state = State::Header;
+	uint32_t m_bits = 0;
+	int m_bit_count = 0;
+
+	uint64_t m_field = 0;
+	int m_field_bytes = 0;
+	uint32_t m_compressed_size = 0;
+	uint32_t m_original_size = 0;
+	uint32_t m_consumed = 0;
+	uint32_t m_produced = 0;
+	uint32_t m_crc = 0;
+	std::string m_error{};
+
+	Lz4State m_lz4_state = Lz4State::Token;
+	size_t m_literal_length = 0;
+	size_t m_match_length = 0;
+	size_t m_offset = 0;
+	std::string m_window{};
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <format>
+
+// Reports how far through a long loop we are, at most once per interval instead of once per item.
+// total is 0 when it isn't known up front.
+class ProgressReporter {
+public:
+	ProgressReporter(std::string label, size_t total, std::chrono::milliseconds interval = std::chrono::milliseconds(500))
+		: m_label(std::move(label)), m_total(total), m_interval(interval)
+	{
+	}
+
+	void update(size_t done)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		if (now - m_last_report < m_interval) return;
+		report(done, now);
+	}
+
+	// always reports, for the end of the loop
+	void finish(size_t done)
+	{
+		report(done, std::chrono::steady_clock::now());
+	}
+
+private:
+	void report(size_t done, std::chrono::steady_clock::time_point now)
+	{
+		m_last_report = now;
+		const double seconds = std::chrono::duration<double>(now - m_start).count();
+		if (m_total > 0) {
+			std::cout << std::format("{}: {}/{} ({:.1f}s)\n", m_label, done, m_total, seconds);
+		}
+		else {
+			std::cout << std::format("{}: {} ({:.1f}s)\n", m_label, done, seconds);
+		}
+	}
+
+	std::string m_label;
+	size_t m_total;
+	std::chrono::milliseconds m_interval;
+	std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point m_last_report = m_start;
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+#include "section_layout.h"
+
+// Levels and bits of every section, chosen by the rateplan tool from how well each section separates the
+// calibration levels. rate_plan.csv: a header line, then "section,bits,levels" for each section, where levels
+// are the 2^bits calibration levels the section uses separated by spaces, and value v is sent as levels[v].
+// A symbol's bits are the sections' values in section order, each least significant bit first.
+struct SectionRate {
+	int bits = 0;
+	std::vector<int> levels{};
+};
+using RatePlan = std::array<SectionRate, SECTION_COUNT>;
+constexpr int MAX_SECTION_BITS = std::bit_width(unsigned(LEVEL_COUNT)) - 1;
+
+inline RatePlan loadRatePlan(const std::string& path) {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + path);
+	}
+
+	RatePlan plan{};
+	std::array<bool, SECTION_COUNT> seen{};
+	std::string line;
+	// Skip header line
+	std::getline(file, line);
+	while (std::getline(file, line)) {
+		if (line.empty()) continue;
+
+		std::stringstream ss(line);
+		std::string token;
+		int section_index = -1;
+		SectionRate rate{};
+		if (std::getline(ss, token, ',')) section_index = std::stoi(token);
+		if (std::getline(ss, token, ',')) rate.bits = std::stoi(token);
+		if (std::getline(ss, token, ',')) {
+			std::stringstream levels(token);
+			int level{};
+			while (levels >> level) {
+				rate.levels.push_back(level);
+			}
+		}
+
+		std::vector<int> sorted = rate.levels;
+		std::ranges::sort(sorted);
+		if (section_index < 0 || section_index >= SECTION_COUNT || rate.bits < 0 || rate.bits > MAX_SECTION_BITS
+			|| rate.levels.size() != (1u << rate.bits) || std::ranges::adjacent_find(sorted) != sorted.end()
+			|| std::ranges::any_of(rate.levels, [](int level) { return level < 0 || level >= LEVEL_COUNT; })) {
+			throw std::runtime_error("Bad line in rate plan " + path + ": " + line);
+		}
+		plan[section_index] = std::move(rate);
+		seen[section_index] = true;
+	}
+	if (!std::ranges::all_of(seen, [](bool s) { return s; })) {
+		throw std::runtime_error("Rate plan doesn't cover every section: " + path);
+	}
+	return plan;
+}
+
+inline void saveRatePlan(const std::string& path, const RatePlan& plan) {
+	std::ofstream file(path);
+	if (!file) {
+		throw std::runtime_error("Failed to create file for writing");
+	}
+	file << "section,bits,levels\n";
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		file << section_index << "," << plan[section_index].bits << ",";
+		for (size_t i = 0; i < plan[section_index].levels.size(); ++i) {
+			file << (i > 0 ? " " : "") << plan[section_index].levels[i];
+		}
+		file << "\n";
+	}
+}
+
+// Characters sent with a rate plan. Every symbol adds each section's value (least significant bit first) to one
+// bit stream, read as bytes of 7 data bits and a parity bit like the fixed layout's characters, so characters
+// can straddle symbols. A bit is uncertain if its section's runner up level has the other value for it, and a
+// byte failing parity has its most uncertain bit flipped if that's at least erasure_ambiguity.
+class PlanBitReader {
+public:
+	explicit PlanBitReader(float erasure_ambiguity)
+		: m_erasure_ambiguity(erasure_ambiguity)
+	{
+	}
+
+	// runner_up is the value of the section's second most likely level, -1 if there's none
+	void push(int value, int runner_up, int bits, float ambiguity)
+	{
+		for (int b = 0; b < bits; ++b) {
+			const bool bit = (value >> b) & 1;
+			const bool uncertain = runner_up >= 0 && (((runner_up >> b) & 1) != 0) != bit;
+			m_bits.push_back(bit);
+			m_ambiguity.push_back(uncertain ? ambiguity : 0.0f);
+		}
+	}
+
+	// The characters completed since the last call. Those still failing parity are counted in errors.
+	std::string take(int& errors, int& corrected)
+	{
+		std::string res{};
+		size_t pos = 0;
+		for (; pos + 8 <= m_bits.size(); pos += 8) {
+			unsigned char c = 0;
+			for (int b = 0; b < 8; ++b) {
+				c |= m_bits[pos + b] << b;
+			}
+			// the parity bit is the parity of the data bits, so all 8 have even parity
+			if (std::popcount(c) & 1) {
+				const auto first = m_ambiguity.begin() + pos;
+				const auto erased = std::max_element(first, first + 8);
+				if (*erased >= m_erasure_ambiguity) {
+					c ^= 1 << (erased - first);
+					++corrected;
+				}
+				else {
+					++errors;
+				}
+			}
+			res += static_cast<char>(c & 0x7F);
+		}
+		m_bits.erase(m_bits.begin(), m_bits.begin() + pos);
+		m_ambiguity.erase(m_ambiguity.begin(), m_ambiguity.begin() + pos);
+		return res;
+	}
+
+	// bits pushed that don't make a whole character yet, at the end of a decode these were never read
+	size_t pendingBits() const
+	{
+		return m_bits.size();
+	}
+
+private:
+	std::vector<bool> m_bits{};
+	std::vector<float> m_ambiguity{};
+	float m_erasure_ambiguity;
+};
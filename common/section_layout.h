@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <span>
+#include <algorithm>
+
+// The text layout every decoder shares: 109 boxes (rows of bboxes.csv) in 8 sections, each showing one of 8 levels
+constexpr int SECTION_COUNT = 8;
+constexpr int LEVEL_COUNT = 8;
+constexpr int BOX_COUNT = 109;
+
+// box indices (rows of bboxes.csv) making up each section
+constexpr std::array<int, 17> SECTION_0_BOXES{ 0, 1, 2, 3, 4, 20, 21, 22, 23, 24, 25, 41, 42, 43, 44, 45, 46 };
+constexpr std::array<int, 24> SECTION_1_BOXES{ 5, 6, 7, 8, 9, 10, 11, 12, 26, 27, 28, 29, 30, 31, 32, 33, 47, 48, 49, 50, 51, 52, 53, 73 };
+constexpr std::array<int, 9> SECTION_2_BOXES{ 13, 14, 15, 34, 35, 36, 54, 55, 56 };
+constexpr std::array<int, 12> SECTION_3_BOXES{ 16, 17, 18, 19, 37, 38, 39, 40, 57, 58, 59, 77 };
+constexpr std::array<int, 16> SECTION_4_BOXES{ 60, 61, 62, 63, 64, 65, 78, 79, 80, 81, 82, 83, 95, 96, 97, 98 };
+constexpr std::array<int, 18> SECTION_5_BOXES{ 66, 67, 68, 69, 70, 71, 72, 84, 85, 86, 87, 88, 89, 90, 99, 100, 101, 102 };
+constexpr std::array<int, 4> SECTION_6_BOXES{ 91, 103, 104, 105 };
+constexpr std::array<int, 9> SECTION_7_BOXES{ 74, 75, 76, 92, 93, 94, 106, 107, 108 };
+
+constexpr std::array<std::span<const int>, SECTION_COUNT> SECTION_BOXES{
+	SECTION_0_BOXES,
+	SECTION_1_BOXES,
+	SECTION_2_BOXES,
+	SECTION_3_BOXES,
+	SECTION_4_BOXES,
+	SECTION_5_BOXES,
+	SECTION_6_BOXES,
+	SECTION_7_BOXES,
+};
+
+constexpr std::array<int, BOX_COUNT> getIndexToSection(const std::array<std::span<const int>, SECTION_COUNT>& sections) {
+	std::array<int, BOX_COUNT> res{};
+	res.fill(-1);
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		for (const int i : sections[section_index]) {
+			res[i] = section_index;
+		}
+	}
+	return res;
+}
+
+// section index of each box
+constexpr std::array<int, BOX_COUNT> BOX_SECTIONS = getIndexToSection(SECTION_BOXES);
+static_assert(std::ranges::find(BOX_SECTIONS, -1) == BOX_SECTIONS.end(), "every box must belong to a section");
@@ -0,0 +1,495 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <format>
+#include <filesystem>
+#include <optional>
+#include <cstring>
+#include <cerrno>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include "decoder_session.h"
+
+#ifdef _WIN32
+using socket_t = SOCKET;
+constexpr socket_t INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+static void closeSocket(socket_t s) { closesocket(s); }
+constexpr int SEND_FLAGS = 0;
+static void setReceiveTimeout(socket_t s, int seconds) {
+	const DWORD timeout_ms = seconds * 1000;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout_ms, sizeof(timeout_ms));
+}
+static bool receiveTimedOut() { return WSAGetLastError() == WSAETIMEDOUT; }
+#else
+using socket_t = int;
+constexpr socket_t INVALID_SOCKET_HANDLE = -1;
+static void closeSocket(socket_t s) { close(s); }
+// a client that hung up is an error for its job, not a signal that stops the service
+constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+static void setReceiveTimeout(socket_t s, int seconds) {
+	const timeval timeout{ seconds, 0 };
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+static bool receiveTimedOut() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+#endif
+
+// Least recently used cache of immutable values shared with the jobs using them. Values are built
+// outside the lock, so a slow build doesn't hold up jobs that hit the cache.
+template <typename Value>
+class LruCache {
+public:
+	explicit LruCache(size_t capacity) : m_capacity(capacity) {}
+
+	std::shared_ptr<const Value> get(const std::string& key, const std::function<std::shared_ptr<const Value>()>& make)
+	{
+		if (auto res = lookup(key)) {
+			return res;
+		}
+		auto value = make();
+		std::scoped_lock lock(m_mutex);
+		// another job may have built it meanwhile, keep the first so everyone shares one copy
+		if (auto res = findLocked(key)) {
+			return res;
+		}
+		storeLocked(key, value);
+		return value;
+	}
+
+	// nullptr if it isn't cached
+	std::shared_ptr<const Value> lookup(const std::string& key)
+	{
+		std::scoped_lock lock(m_mutex);
+		return findLocked(key);
+	}
+
+	void store(const std::string& key, std::shared_ptr<const Value> value)
+	{
+		std::scoped_lock lock(m_mutex);
+		storeLocked(key, std::move(value));
+	}
+
+private:
+	std::shared_ptr<const Value> findLocked(const std::string& key)
+	{
+		auto it = m_index.find(key);
+		if (it == m_index.end()) return nullptr;
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		return it->second->second;
+	}
+
+	void storeLocked(const std::string& key, std::shared_ptr<const Value> value)
+	{
+		if (auto it = m_index.find(key); it != m_index.end()) {
+			it->second->second = std::move(value);
+			m_entries.splice(m_entries.begin(), m_entries, it->second);
+			return;
+		}
+		m_entries.emplace_front(key, std::move(value));
+		m_index[key] = m_entries.begin();
+		if (m_entries.size() > m_capacity) {
+			m_index.erase(m_entries.back().first);
+			m_entries.pop_back();
+		}
+	}
+
+	size_t m_capacity;
+	std::mutex m_mutex{};
+	std::list<std::pair<std::string, std::shared_ptr<const Value>>> m_entries{};
+	std::unordered_map<std::string, typename std::list<std::pair<std::string, std::shared_ptr<const Value>>>::iterator> m_index{};
+};
+
+// Fixed number of threads running queued jobs
+class WorkerPool {
+public:
+	explicit WorkerPool(size_t thread_count)
+	{
+		for (size_t i = 0; i < thread_count; ++i) {
+			m_threads.emplace_back([this] { run(); });
+		}
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::scoped_lock lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (auto& thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	void submit(std::function<void()> job)
+	{
+		{
+			std::scoped_lock lock(m_mutex);
+			m_jobs.push_back(std::move(job));
+		}
+		m_cv.notify_one();
+	}
+
+private:
+	void run()
+	{
+		while (true) {
+			std::function<void()> job;
+			{
+				std::unique_lock lock(m_mutex);
+				m_cv.wait(lock, [&] { return m_stop || !m_jobs.empty(); });
+				if (m_jobs.empty()) return;
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+			job();
+		}
+	}
+
+	std::vector<std::thread> m_threads{};
+	std::mutex m_mutex{};
+	std::condition_variable m_cv{};
+	std::deque<std::function<void()>> m_jobs{};
+	bool m_stop = false;
+};
+
+// A client connection. Reads are buffered, so the request line and the frames sent straight after it
+// can be read separately.
+class Connection {
+public:
+	explicit Connection(socket_t s) : m_socket(s) {}
+	~Connection() { closeSocket(m_socket); }
+
+	Connection(const Connection&) = delete;
+	Connection& operator=(const Connection&) = delete;
+
+	bool readLine(std::string& line)
+	{
+		while (true) {
+			if (auto end = m_buffer.find('\n'); end != std::string::npos) {
+				line = m_buffer.substr(0, end);
+				m_buffer.erase(0, end + 1);
+				if (!line.empty() && line.back() == '\r') line.pop_back();
+				return true;
+			}
+			if (!fill()) return false;
+		}
+	}
+
+	// false if the connection closed first
+	bool read(uint8_t* data, size_t size)
+	{
+		while (m_buffer.size() < size) {
+			if (!fill()) return false;
+		}
+		std::memcpy(data, m_buffer.data(), size);
+		m_buffer.erase(0, size);
+		return true;
+	}
+
+	void write(std::string_view data)
+	{
+		while (!data.empty()) {
+			const int sent = send(m_socket, data.data(), (int)data.size(), SEND_FLAGS);
+			if (sent <= 0) {
+				throw std::runtime_error("Connection closed while sending");
+			}
+			data.remove_prefix(sent);
+		}
+	}
+
+private:
+	bool fill()
+	{
+		char chunk[65536];
+		const int received = recv(m_socket, chunk, sizeof(chunk), 0);
+		if (received < 0 && receiveTimedOut()) {
+			throw std::runtime_error("Timed out waiting for the client");
+		}
+		if (received <= 0) return false;
+		m_buffer.append(chunk, received);
+		return true;
+	}
+
+	socket_t m_socket;
+	std::string m_buffer{};
+};
+
+// A request is one line, a command then tab separated key=value fields:
+//   decode  video=<path> bboxes=<path> mask=<path> corners=x0,y0,x1,y1,x2,y2,x3,y3
+//           calibration_start=<frame> decode_start=<frame> symbol_count=<n>
+//           [symbol_frames=24] [calibration_step=48] [calibration=<name>]
+//   stream  the same without video, plus frame_size=<w>x<h> (at most 8K) [first_frame=<frame>]; the request is
+//           followed by packed BGR24 frames until the job finishes or the client closes its side
+// calibration names a calibration to reuse (and to keep after the job), by default a video's
+// calibration is kept under its path and calibration frames.
+// The reply is "ok symbols=<n> errors=<n> bytes=<n>" and a newline followed by the decoded text,
+// or "error <message>" and a newline.
+static std::map<std::string, std::string> parseFields(std::string_view line, std::string& command) {
+	std::map<std::string, std::string> fields{};
+	size_t pos = 0;
+	bool first = true;
+	while (pos <= line.size()) {
+		size_t end = line.find('\t', pos);
+		if (end == std::string_view::npos) end = line.size();
+		const std::string_view field = line.substr(pos, end - pos);
+		if (first) {
+			command = std::string(field);
+			first = false;
+		}
+		else if (!field.empty()) {
+			const size_t eq = field.find('=');
+			if (eq == std::string_view::npos) {
+				throw std::runtime_error("Expected key=value, got " + std::string(field));
+			}
+			fields[std::string(field.substr(0, eq))] = std::string(field.substr(eq + 1));
+		}
+		pos = end + 1;
+	}
+	return fields;
+}
+
+static const std::string& requireField(const std::map<std::string, std::string>& fields, const std::string& key) {
+	auto it = fields.find(key);
+	if (it == fields.end()) {
+		throw std::runtime_error("Missing " + key);
+	}
+	return it->second;
+}
+
+static int intField(const std::map<std::string, std::string>& fields, const std::string& key, std::optional<int> fallback = {}) {
+	auto it = fields.find(key);
+	if (it == fields.end()) {
+		if (!fallback) {
+			throw std::runtime_error("Missing " + key);
+		}
+		return *fallback;
+	}
+	return std::stoi(it->second);
+}
+
+// Cache key for a file's contents: its path and when it was last written, so an edited file is read again
+static std::string fileKey(const std::string& path) {
+	std::error_code ec{};
+	const auto write_time = std::filesystem::last_write_time(path, ec);
+	// a missing file fails when it's read, it's never cached
+	return std::format("{}@{}", path, ec ? 0 : (long long)write_time.time_since_epoch().count());
+}
+
+// Largest frame a stream may send (8K UHD)
+const cv::Size MAX_FRAME_SIZE{ 7680, 4320 };
+
+// Everything kept between jobs
+struct ServiceState {
+	LruCache<std::vector<DecoderBox>> boxes{ 16 };
+	LruCache<cv::Mat> masks{ 16 };
+	LruCache<DecoderGeometry> geometries{ 32 };
+	LruCache<DecoderCalibration> calibrations{ 64 };
+};
+
+static void runJob(ServiceState& state, Connection& connection) {
+	std::string line;
+	if (!connection.readLine(line)) return;
+
+	std::string command;
+	const auto fields = parseFields(line, command);
+	if (command != "decode" && command != "stream") {
+		throw std::runtime_error("Unknown command " + command);
+	}
+	const bool streamed = command == "stream";
+
+	DecoderConfig config{};
+	const std::string& bboxes_path = requireField(fields, "bboxes");
+	const std::string& mask_path = requireField(fields, "mask");
+	const std::string bboxes_key = fileKey(bboxes_path);
+	const std::string mask_key = fileKey(mask_path);
+	config.boxes = *state.boxes.get(bboxes_key, [&] {
+		return std::make_shared<const std::vector<DecoderBox>>(loadDecoderBoxes(bboxes_path));
+		});
+	config.mask = *state.masks.get(mask_key, [&] {
+		cv::Mat mask = cv::imread(mask_path);
+		if (mask.empty()) {
+			throw std::runtime_error("Failed to read mask image: " + mask_path);
+		}
+		return std::make_shared<const cv::Mat>(mask);
+		});
+
+	const std::string& corners = requireField(fields, "corners");
+	{
+		std::stringstream ss(corners);
+		std::string token;
+		for (auto& corner : config.corners) {
+			std::getline(ss, token, ',');
+			corner.x = std::stof(token);
+			std::getline(ss, token, ',');
+			corner.y = std::stof(token);
+		}
+	}
+
+	cv::VideoCapture cap{};
+	std::string video_path{};
+	if (streamed) {
+		const std::string& frame_size = requireField(fields, "frame_size");
+		const size_t x = frame_size.find('x');
+		if (x == std::string::npos) {
+			throw std::runtime_error("frame_size must be <width>x<height>");
+		}
+		config.frame_size = cv::Size(std::stoi(frame_size.substr(0, x)), std::stoi(frame_size.substr(x + 1)));
+		// every frame is buffered at this size, so a bad size mustn't allocate without limit
+		if (config.frame_size.width <= 0 || config.frame_size.height <= 0
+			|| config.frame_size.width > MAX_FRAME_SIZE.width || config.frame_size.height > MAX_FRAME_SIZE.height) {
+			throw std::runtime_error(std::format("frame_size must be positive and at most {}x{}", MAX_FRAME_SIZE.width, MAX_FRAME_SIZE.height));
+		}
+		config.first_frame = intField(fields, "first_frame", 0);
+	}
+	else {
+		video_path = requireField(fields, "video");
+		cap.open(video_path);
+		if (!cap.isOpened()) {
+			throw std::runtime_error("Could not open video: " + video_path);
+		}
+		config.frame_size = cv::Size((int)cap.get(cv::CAP_PROP_FRAME_WIDTH), (int)cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+	}
+
+	config.calibration_start_frame = intField(fields, "calibration_start");
+	config.calibration_frame_step = intField(fields, "calibration_step", 48);
+	config.decode_start_frame = intField(fields, "decode_start");
+	config.symbol_frames = intField(fields, "symbol_frames", 24);
+	config.symbol_count = intField(fields, "symbol_count");
+
+	const std::string geometry_key = std::format("{}|{}|{}|{}x{}", bboxes_key, mask_key, corners, config.frame_size.width, config.frame_size.height);
+	config.geometry = state.geometries.get(geometry_key, [&] { return computeDecoderGeometry(config); });
+
+	std::string calibration_key{};
+	if (auto it = fields.find("calibration"); it != fields.end()) {
+		calibration_key = it->second;
+	}
+	else if (!streamed) {
+		calibration_key = std::format("{}|{}|{}|{}", fileKey(video_path), config.calibration_start_frame, config.calibration_frame_step, geometry_key);
+	}
+
+	std::string text{};
+	DecoderCallbacks callbacks{};
+	callbacks.symbol = [&](const DecodedSymbol& symbol) {
+		text.append(symbol.chars.data(), symbol.chars.size());
+	};
+	callbacks.calibrated = [&](const DecoderCalibration& calibration) {
+		if (!calibration_key.empty()) {
+			state.calibrations.store(calibration_key, std::make_shared<const DecoderCalibration>(calibration));
+		}
+	};
+
+	auto cached_calibration = calibration_key.empty() ? nullptr : state.calibrations.lookup(calibration_key);
+	std::unique_ptr<DecoderSession> session = cached_calibration
+		? std::make_unique<DecoderSession>(config, *cached_calibration, callbacks)
+		: std::make_unique<DecoderSession>(config, callbacks);
+
+	if (streamed) {
+		const size_t frame_bytes = (size_t)config.frame_size.width * config.frame_size.height * 3;
+		std::vector<uint8_t> frame(frame_bytes);
+		while (!session->isFinished() && connection.read(frame.data(), frame_bytes)) {
+			session->pushFrame(frame.data(), (size_t)config.frame_size.width * 3);
+		}
+	}
+	else {
+		// only the frames the session wants are decoded, seeking past long gaps
+		int next_video_frame = 0;
+		cv::Mat frame;
+		for (int wanted = session->nextWantedFrame(); wanted >= 0; wanted = session->nextWantedFrame()) {
+			if (wanted < next_video_frame || wanted - next_video_frame > 2 * config.symbol_frames) {
+				cap.set(cv::CAP_PROP_POS_FRAMES, wanted);
+			}
+			else {
+				for (; next_video_frame < wanted; ++next_video_frame) {
+					cap.grab();
+				}
+			}
+			if (!cap.read(frame)) {
+				throw std::runtime_error(std::format("Failed to read frame {} of {}", wanted, video_path));
+			}
+			next_video_frame = wanted + 1;
+			session->skipTo(wanted);
+			session->pushFrame(frame);
+		}
+	}
+
+	connection.write(std::format("ok symbols={} errors={} bytes={}\n", text.size() / 3, session->errors(), text.size()));
+	connection.write(text);
+}
+
+int main()
+{
+	std::string socket_path = "decode_service.sock";
+
+	// jobs decoded at the same time, each on its own thread
+	const size_t WORKER_COUNT = std::max(1u, std::thread::hardware_concurrency());
+	// a client that sends nothing for this long is dropped, so idle clients can't hold every worker
+	constexpr int RECEIVE_TIMEOUT_SECONDS = 30;
+
+#ifdef _WIN32
+	WSADATA wsa_data{};
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+		throw std::runtime_error("Failed to start winsock");
+	}
+#endif
+
+	socket_t listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET_HANDLE) {
+		throw std::runtime_error("Failed to create socket");
+	}
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Socket path is too long: " + socket_path);
+	}
+	std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+	// left behind by a previous run
+	std::filesystem::remove(socket_path);
+	if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+		throw std::runtime_error("Failed to listen on " + socket_path);
+	}
+	std::cout << "Listening on " << socket_path << " with " << WORKER_COUNT << " workers\n";
+
+	ServiceState state{};
+	WorkerPool workers(WORKER_COUNT);
+	while (true) {
+		socket_t client = accept(listener, nullptr, nullptr);
+		if (client == INVALID_SOCKET_HANDLE) continue;
+		setReceiveTimeout(client, RECEIVE_TIMEOUT_SECONDS);
+		workers.submit([&state, client] {
+			Connection connection(client);
+			try {
+				runJob(state, connection);
+			}
+			catch (const std::exception& e) {
+				try {
+					connection.write(std::string("error ") + e.what() + "\n");
+				}
+				catch (const std::exception&) {
+					// the client has gone
+				}
+			}
+			});
+	}
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Text decoding (8 sections x 8 levels, three 7 bit characters and their parity per symbol, like
+// text_decoder2) as a library, so a long running process can decode many captures at once without
+// starting a decoder per job. A session keeps all of its state itself: nothing global, nothing
+// printed or shown, errors are thrown as std::runtime_error.
+
+constexpr int DECODER_SECTION_COUNT = 8;
+constexpr int DECODER_LEVEL_COUNT = 8;
+constexpr int DECODER_BOX_COUNT = 109;
+
+// One box of the transmitted layout, in screen pixels (a row of bboxes.csv)
+struct DecoderBox {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+// bboxes.csv: a header line, then x,y,w,h per box
+std::vector<DecoderBox> loadDecoderBoxes(const std::string& filename);
+
+// The frame pixels sampled for every box, worked out from the boxes, mask, corners and sizes
+// of a DecoderConfig. Immutable, so one can be shared by any number of sessions.
+struct DecoderGeometry;
+
+struct DecoderConfig {
+	std::vector<DecoderBox> boxes{};   // DECODER_BOX_COUNT boxes
+	cv::Mat mask{};                    // screen sized, boxes are sampled where green is 255
+	cv::Size screen_size{ 1920, 1080 };
+	std::array<cv::Point2f, 4> corners{}; // the screen's corners in the frame: topleft, topright, bottomleft, bottomright
+	cv::Size frame_size{ 1920, 1080 };
+	// from computeDecoderGeometry for the same boxes, mask, corners and sizes, to skip working it out again
+	std::shared_ptr<const DecoderGeometry> geometry{};
+
+	// index of the first frame passed to pushFrame, every push is the next frame
+	int first_frame = 0;
+
+	// level n is shown at calibration_start_frame + n * calibration_frame_step, all before decode_start_frame
+	int calibration_start_frame = 0;
+	int calibration_frame_step = 48;
+
+	// symbol n is decoded from decode_start_frame + n * symbol_frames
+	int decode_start_frame = 0;
+	int symbol_frames = 24;
+	int symbol_count = 0;
+
+	// Palette drift tracking: weight of each confidently decoded colour, 0 disables it.
+	// Only colours this much closer to their entry than to the runner up are trusted.
+	float drift_alpha = 0.0f;
+	float drift_max_distance_ratio = 0.5f;
+};
+
+// Measured colour of every level of every section. Save it to start later sessions of the same
+// setup already calibrated (see DecoderSession::calibrated()).
+struct DecoderCalibration {
+	std::array<std::array<cv::Vec3b, DECODER_LEVEL_COUNT>, DECODER_SECTION_COUNT> palettes{};
+};
+
+std::shared_ptr<const DecoderGeometry> computeDecoderGeometry(const DecoderConfig& config);
+
+// Average colour of every section of a BGR frame of the geometry's frame size. Not rounded, for tools
+// that weigh how far a colour is from each level rather than only picking the nearest.
+std::array<cv::Vec3f, DECODER_SECTION_COUNT> sampleDecoderSections(const DecoderGeometry& geometry, const cv::Mat& frame);
+
+struct DecodedSymbol {
+	int symbol = 0;
+	int frame = 0;
+	std::array<char, 3> chars{};
+	int parity_errors = 0;
+};
+
+// Called on the thread that pushed the frame, with the session locked, so they mustn't call back into it
+struct DecoderCallbacks {
+	std::function<void(const DecoderCalibration&)> calibrated{};
+	std::function<void(const DecodedSymbol&)> symbol{};
+	std::function<void()> finished{};
+};
+
+// Decodes one capture from its frames, pushed in order. All the sampling geometry is worked out
+// in the constructor. Every method can be called from any thread, a session serialises its own
+// calls and separate sessions share nothing.
+class DecoderSession {
+public:
+	DecoderSession(DecoderConfig config, DecoderCallbacks callbacks);
+	// Starts already calibrated, calibration frames are then ignored
+	DecoderSession(DecoderConfig config, const DecoderCalibration& calibration, DecoderCallbacks callbacks);
+	~DecoderSession();
+
+	DecoderSession(const DecoderSession&) = delete;
+	DecoderSession& operator=(const DecoderSession&) = delete;
+
+	// BGR frame of config.frame_size
+	void pushFrame(const cv::Mat& frame);
+	// Packed BGR24 rows of config.frame_size, step bytes apart. Only read during the call.
+	void pushFrame(const uint8_t* data, size_t step);
+
+	// Index of the next frame the session will use, -1 once it's finished. Frames before it can be
+	// passed over with skipTo instead of being decoded and pushed.
+	int nextWantedFrame() const;
+	// the next frame pushed is frame_index, which mustn't be before the next expected frame or past nextWantedFrame()
+	void skipTo(int frame_index);
+
+	bool isCalibrated() const;
+	// true once the last symbol has been decoded, later frames are ignored
+	bool isFinished() const;
+	// current palettes, including any tracked drift
+	DecoderCalibration calibration() const;
+	int errors() const;
+
+private:
+	struct State;
+
+	void processFrame(const cv::Mat& frame);
+
+	mutable std::mutex m_mutex{};
+	std::unique_ptr<State> m_state;
+};
@@ -0,0 +1,331 @@
+#include "decoder_session.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <bit>
+#include <limits>
+#include <stdexcept>
+
+#include "palette_tracker.h"
+#include "closest_match.h"
+#include "box_sampling.h"
+#include "section_layout.h"
+
+namespace {
+
+static_assert(DECODER_SECTION_COUNT == SECTION_COUNT && DECODER_LEVEL_COUNT == LEVEL_COUNT && DECODER_BOX_COUNT == BOX_COUNT,
+	"the public constants must match the shared layout");
+
+// Maps the boxes into the frame and finds the pixels inside each that pass the mask
+std::vector<std::vector<cv::Point>> computeConfigSamplePoints(const DecoderConfig& config) {
+	if (config.boxes.size() != DECODER_BOX_COUNT) {
+		throw std::runtime_error("Expected " + std::to_string(DECODER_BOX_COUNT) + " boxes, got " + std::to_string(config.boxes.size()));
+	}
+	if (config.mask.empty() || config.mask.type() != CV_8UC3) {
+		throw std::runtime_error("Mask must be a BGR image");
+	}
+
+	std::array<cv::Point2f, 4> screen_corners{};
+	screen_corners[0] = cv::Point2f(0, 0);
+	screen_corners[1] = cv::Point2f((float)config.screen_size.width - 1, 0);
+	screen_corners[2] = cv::Point2f(0, (float)config.screen_size.height - 1);
+	screen_corners[3] = cv::Point2f((float)config.screen_size.width - 1, (float)config.screen_size.height - 1);
+	cv::Mat H = cv::findHomography(screen_corners, config.corners);
+	cv::Mat H_inv = H.inv();
+
+	std::vector<std::array<cv::Point2f, 4>> transformed_boxes{};
+	for (const auto& box : config.boxes) {
+		std::vector<cv::Point2f> src_points{
+			cv::Point2f(box.x, box.y),
+			cv::Point2f(box.x + box.w, box.y),
+			cv::Point2f(box.x, box.y + box.h),
+			cv::Point2f(box.x + box.w, box.y + box.h),
+		};
+		std::vector<cv::Point2f> dst_points{};
+		cv::perspectiveTransform(src_points, dst_points, H);
+		transformed_boxes.push_back({ dst_points[0], dst_points[1], dst_points[2], dst_points[3] });
+	}
+	return computeBoxSamplePoints(transformed_boxes, config.mask, H_inv, config.frame_size);
+}
+
+// Sum of the sampled pixels of every section and how many there are, in one pass over the boxes
+struct SectionSums {
+	std::array<cv::Vec3i, DECODER_SECTION_COUNT> sums{};
+	std::array<int, DECODER_SECTION_COUNT> counts{};
+};
+
+SectionSums sumSections(const cv::Mat& frame, const std::vector<std::vector<cv::Point>>& box_sample_points) {
+	SectionSums res{};
+	for (int box_index = 0; box_index < DECODER_BOX_COUNT; ++box_index) {
+		const int section_index = BOX_SECTIONS[box_index];
+		cv::Vec3i sum{};
+		for (const cv::Point& p : box_sample_points[box_index]) {
+			const cv::Vec3b& col = frame.ptr<cv::Vec3b>(p.y)[p.x];
+			sum[0] += col[0];
+			sum[1] += col[1];
+			sum[2] += col[2];
+		}
+		res.sums[section_index] += sum;
+		res.counts[section_index] += (int)box_sample_points[box_index].size();
+	}
+	return res;
+}
+
+// Averages the sampled pixels of every box into its section
+std::array<cv::Vec3b, DECODER_SECTION_COUNT> sampleSections(const cv::Mat& frame, const std::vector<std::vector<cv::Point>>& box_sample_points) {
+	const auto [sums, counts] = sumSections(frame, box_sample_points);
+	std::array<cv::Vec3b, DECODER_SECTION_COUNT> res{};
+	for (int i = 0; i < DECODER_SECTION_COUNT; ++i) {
+		if (counts[i] == 0) continue;
+		res[i][0] = static_cast<uchar>((sums[i][0] + counts[i] / 2) / counts[i]);
+		res[i][1] = static_cast<uchar>((sums[i][1] + counts[i] / 2) / counts[i]);
+		res[i][2] = static_cast<uchar>((sums[i][2] + counts[i] / 2) / counts[i]);
+	}
+	return res;
+}
+
+} // namespace
+
+struct DecoderGeometry {
+	cv::Size frame_size;
+	std::vector<std::vector<cv::Point>> box_sample_points;
+};
+
+std::shared_ptr<const DecoderGeometry> computeDecoderGeometry(const DecoderConfig& config) {
+	return std::make_shared<const DecoderGeometry>(DecoderGeometry{ config.frame_size, computeConfigSamplePoints(config) });
+}
+
+std::array<cv::Vec3f, DECODER_SECTION_COUNT> sampleDecoderSections(const DecoderGeometry& geometry, const cv::Mat& frame) {
+	if (frame.size() != geometry.frame_size || frame.type() != CV_8UC3) {
+		throw std::runtime_error("Frame must be BGR and the geometry's frame size");
+	}
+	const auto [sums, counts] = sumSections(frame, geometry.box_sample_points);
+	std::array<cv::Vec3f, DECODER_SECTION_COUNT> res{};
+	for (int i = 0; i < DECODER_SECTION_COUNT; ++i) {
+		if (counts[i] == 0) continue;
+		res[i] = cv::Vec3f((float)sums[i][0] / counts[i], (float)sums[i][1] / counts[i], (float)sums[i][2] / counts[i]);
+	}
+	return res;
+}
+
+std::vector<DecoderBox> loadDecoderBoxes(const std::string& filename) {
+	std::vector<DecoderBox> boxes;
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + filename);
+	}
+
+	std::string line;
+
+	// Skip header line
+	if (!std::getline(file, line)) {
+		return boxes; // empty file
+	}
+
+	while (std::getline(file, line)) {
+		if (line.empty()) continue;
+
+		std::stringstream ss(line);
+		std::string token;
+		DecoderBox b{};
+
+		if (std::getline(ss, token, ',')) b.x = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.y = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.w = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.h = std::stoi(token);
+
+		boxes.push_back(b);
+	}
+
+	return boxes;
+}
+
+struct DecoderSession::State {
+	DecoderConfig config;
+	DecoderCallbacks callbacks;
+	std::shared_ptr<const DecoderGeometry> geometry{};
+	DecoderCalibration calibration{};
+	std::vector<PaletteTracker<DECODER_LEVEL_COUNT>> trackers{};
+	int next_frame = 0;
+	int levels_calibrated = 0;
+	int next_symbol = 0;
+	int errors = 0;
+
+	bool calibrated() const { return levels_calibrated == DECODER_LEVEL_COUNT; }
+	bool finished() const { return next_symbol >= config.symbol_count; }
+
+	int nextWantedFrame() const
+	{
+		if (finished()) return -1;
+		if (!calibrated()) return config.calibration_start_frame + levels_calibrated * config.calibration_frame_step;
+		return config.decode_start_frame + next_symbol * config.symbol_frames;
+	}
+
+	void startTracking()
+	{
+		trackers.clear();
+		for (auto& palette : calibration.palettes) {
+			trackers.emplace_back(palette, config.drift_alpha, config.drift_max_distance_ratio);
+		}
+	}
+};
+
+DecoderSession::DecoderSession(DecoderConfig config, DecoderCallbacks callbacks)
+	: m_state(std::make_unique<State>())
+{
+	if (config.symbol_frames <= 0 || config.calibration_frame_step <= 0) {
+		throw std::runtime_error("Frame steps must be positive");
+	}
+	if (config.symbol_count <= 0) {
+		throw std::runtime_error("Symbol count must be positive");
+	}
+	if (config.geometry && config.geometry->frame_size != config.frame_size) {
+		throw std::runtime_error("Geometry was computed for a different frame size");
+	}
+
+	m_state->geometry = config.geometry ? config.geometry : computeDecoderGeometry(config);
+	m_state->next_frame = config.first_frame;
+	m_state->config = std::move(config);
+	m_state->callbacks = std::move(callbacks);
+}
+
+DecoderSession::DecoderSession(DecoderConfig config, const DecoderCalibration& calibration, DecoderCallbacks callbacks)
+	: DecoderSession(std::move(config), std::move(callbacks))
+{
+	m_state->calibration = calibration;
+	m_state->levels_calibrated = DECODER_LEVEL_COUNT;
+	m_state->startTracking();
+}
+
+DecoderSession::~DecoderSession() = default;
+
+void DecoderSession::pushFrame(const cv::Mat& frame)
+{
+	if (frame.size() != m_state->config.frame_size || frame.type() != CV_8UC3) {
+		throw std::runtime_error("Frame must be BGR and the configured frame size");
+	}
+	std::scoped_lock lock(m_mutex);
+	processFrame(frame);
+}
+
+void DecoderSession::pushFrame(const uint8_t* data, size_t step)
+{
+	if (!data) {
+		throw std::runtime_error("Frame data is null");
+	}
+	if (step < (size_t)m_state->config.frame_size.width * 3) {
+		throw std::runtime_error("Frame step is shorter than a row");
+	}
+	// only wraps the caller's buffer, nothing is copied
+	const cv::Mat frame(m_state->config.frame_size, CV_8UC3, const_cast<uint8_t*>(data), step);
+	std::scoped_lock lock(m_mutex);
+	processFrame(frame);
+}
+
+void DecoderSession::processFrame(const cv::Mat& frame)
+{
+	State& s = *m_state;
+	const int frame_index = s.next_frame++;
+	const DecoderConfig& config = s.config;
+
+	if (!s.calibrated()) {
+		const int offset = frame_index - config.calibration_start_frame;
+		if (offset == s.levels_calibrated * config.calibration_frame_step) {
+			auto section_colors = sampleSections(frame, s.geometry->box_sample_points);
+			for (int section_index = 0; section_index < DECODER_SECTION_COUNT; ++section_index) {
+				s.calibration.palettes[section_index][s.levels_calibrated] = section_colors[section_index];
+			}
+			if (++s.levels_calibrated == DECODER_LEVEL_COUNT) {
+				s.startTracking();
+				if (s.callbacks.calibrated) {
+					s.callbacks.calibrated(s.calibration);
+				}
+			}
+		}
+		return;
+	}
+
+	if (s.finished() || frame_index != config.decode_start_frame + s.next_symbol * config.symbol_frames) {
+		return;
+	}
+
+	DecodedSymbol res{};
+	res.symbol = s.next_symbol++;
+	res.frame = frame_index;
+
+	auto section_colors = sampleSections(frame, s.geometry->box_sample_points);
+	std::array<int, DECODER_SECTION_COUNT> levels{};
+	for (int section_index = 0; section_index < DECODER_SECTION_COUNT; ++section_index) {
+		auto match = lookupMatchFromColor(s.calibration.palettes[section_index], section_colors[section_index]);
+		s.trackers[section_index].update(match, section_colors[section_index]);
+		levels[section_index] = match.index;
+	}
+
+	// sections 0-6 carry bit n of each character, section 7 their parity
+	for (int j = 0; j < 3; ++j) {
+		for (int section_index = 0; section_index < 7; ++section_index) {
+			if (((levels[section_index] >> j) & 1) == 1) {
+				res.chars[j] |= (1 << section_index);
+			}
+		}
+		const bool parity = ((levels[7] >> j) & 1) == 1;
+		if ((std::popcount(static_cast<unsigned char>(res.chars[j])) & 1) != parity) {
+			++res.parity_errors;
+		}
+	}
+	s.errors += res.parity_errors;
+
+	if (s.callbacks.symbol) {
+		s.callbacks.symbol(res);
+	}
+	if (s.finished() && s.callbacks.finished) {
+		s.callbacks.finished();
+	}
+}
+
+int DecoderSession::nextWantedFrame() const
+{
+	std::scoped_lock lock(m_mutex);
+	return m_state->nextWantedFrame();
+}
+
+void DecoderSession::skipTo(int frame_index)
+{
+	std::scoped_lock lock(m_mutex);
+	if (frame_index < m_state->next_frame) {
+		throw std::runtime_error("Frames must be pushed in order");
+	}
+	// the session would wait for the passed over frame forever
+	const int wanted = m_state->nextWantedFrame();
+	if (wanted >= 0 && frame_index > wanted) {
+		throw std::runtime_error("Can't skip past frame " + std::to_string(wanted) + ", the session still needs it");
+	}
+	m_state->next_frame = frame_index;
+}
+
+bool DecoderSession::isCalibrated() const
+{
+	std::scoped_lock lock(m_mutex);
+	return m_state->calibrated();
+}
+
+bool DecoderSession::isFinished() const
+{
+	std::scoped_lock lock(m_mutex);
+	return m_state->finished();
+}
+
+DecoderCalibration DecoderSession::calibration() const
+{
+	std::scoped_lock lock(m_mutex);
+	return m_state->calibration;
+}
+
+int DecoderSession::errors() const
+{
+	std::scoped_lock lock(m_mutex);
+	return m_state->errors;
+}
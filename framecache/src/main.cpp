@@ -0,0 +1,187 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <array>
+#include <filesystem>
+#include <format>
+
+#include <opencv2/opencv.hpp>
+
+#include "frame_cache.h"
+
+// Builds a frame cache (see frame_cache.h) holding only the region covered by the boxes
+//
+// framecache <video | directory of frame_NNNNNN.png> <bboxes.csv> <output>
+//     --frames first:step:count   (repeatable)
+//     [--corners x0,y0,x1,y1,x2,y2,x3,y3]   screen corners in the capture (topleft, topright, bottomleft, bottomright)
+//     [--margin pixels]
+
+struct Box {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+static std::vector<Box> loadCsvBoxes(const std::string& filename) {
+	std::vector<Box> boxes;
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + filename);
+	}
+
+	std::string line;
+
+	// Skip header line
+	if (!std::getline(file, line)) {
+		return boxes; // empty file
+	}
+
+	// Parse data lines
+	while (std::getline(file, line)) {
+		if (line.empty()) continue;
+
+		std::stringstream ss(line);
+		std::string token;
+		Box b;
+
+		// Extract 4 integer columns
+		if (std::getline(ss, token, ',')) b.x = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.y = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.w = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.h = std::stoi(token);
+
+		boxes.push_back(b);
+	}
+
+	return boxes;
+}
+
+static std::vector<float> parseNumberList(const std::string& str, char sep) {
+	std::vector<float> values{};
+	std::stringstream ss(str);
+	std::string token;
+	while (std::getline(ss, token, sep)) {
+		values.push_back(std::stof(token));
+	}
+	return values;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 4) {
+		std::cerr << "usage: framecache <video | png directory> <bboxes.csv> <output> --frames first:step:count [--frames ...] [--corners x0,y0,x1,y1,x2,y2,x3,y3] [--margin pixels]\n";
+		return 1;
+	}
+
+	std::string source_path = argv[1];
+	std::string bboxes_path = argv[2];
+	std::string output_path = argv[3];
+
+	std::vector<int> frame_numbers{};
+	std::vector<float> corners{};
+	int margin = 4;
+	for (int i = 4; i + 1 < argc; i += 2) {
+		std::string arg = argv[i];
+		if (arg == "--frames") {
+			auto range = parseNumberList(argv[i + 1], ':');
+			if (range.size() != 3) {
+				throw std::runtime_error("--frames expects first:step:count");
+			}
+			for (int k = 0; k < (int)range[2]; ++k) {
+				frame_numbers.push_back((int)range[0] + k * (int)range[1]);
+			}
+		}
+		else if (arg == "--corners") {
+			corners = parseNumberList(argv[i + 1], ',');
+			if (corners.size() != 8) {
+				throw std::runtime_error("--corners expects 8 values");
+			}
+		}
+		else if (arg == "--margin") {
+			margin = std::stoi(argv[i + 1]);
+		}
+		else {
+			throw std::runtime_error("Unknown argument: " + arg);
+		}
+	}
+	std::sort(frame_numbers.begin(), frame_numbers.end());
+	frame_numbers.erase(std::unique(frame_numbers.begin(), frame_numbers.end()), frame_numbers.end());
+	if (frame_numbers.empty()) {
+		throw std::runtime_error("No frames given");
+	}
+
+	auto boxes = loadCsvBoxes(bboxes_path);
+
+	// box corners in the capture
+	std::vector<cv::Point2f> box_points{};
+	for (const auto& box : boxes) {
+		box_points.push_back(cv::Point2f(box.x, box.y));
+		box_points.push_back(cv::Point2f(box.x + box.w, box.y));
+		box_points.push_back(cv::Point2f(box.x, box.y + box.h));
+		box_points.push_back(cv::Point2f(box.x + box.w, box.y + box.h));
+	}
+	if (!corners.empty()) {
+		std::array<cv::Point2f, 4> srcPnts{};
+		srcPnts[0] = cv::Point2f(0, 0);
+		srcPnts[1] = cv::Point2f(1919, 0);
+		srcPnts[2] = cv::Point2f(0, 1079);
+		srcPnts[3] = cv::Point2f(1919, 1079);
+		std::array<cv::Point2f, 4> dstPnts{};
+		for (int i = 0; i < 4; ++i) {
+			dstPnts[i] = cv::Point2f(corners[i * 2], corners[i * 2 + 1]);
+		}
+		cv::Mat H = cv::findHomography(srcPnts, dstPnts);
+		std::vector<cv::Point2f> transformed{};
+		cv::perspectiveTransform(box_points, transformed, H);
+		box_points = transformed;
+	}
+
+	const bool from_images = std::filesystem::is_directory(source_path);
+	cv::VideoCapture cap{};
+	if (!from_images) {
+		cap.open(source_path);
+		if (!cap.isOpened()) {
+			throw std::runtime_error("Error: Could not open video");
+		}
+	}
+
+	auto readFrame = [&](int frame_number) {
+		cv::Mat frame;
+		if (from_images) {
+			std::string filename = std::format("frame_{:06}.png", frame_number);
+			frame = cv::imread((std::filesystem::path(source_path) / filename).string());
+		}
+		else {
+			cap.set(cv::CAP_PROP_POS_FRAMES, frame_number);
+			cap.read(frame);
+		}
+		if (frame.empty()) {
+			throw std::runtime_error(std::format("Failed to read frame {}", frame_number));
+		}
+		return frame;
+	};
+
+	cv::Mat frame = readFrame(frame_numbers.front());
+
+	// bounding region of all boxes, plus a margin, clipped to the frame
+	cv::Rect roi = cv::boundingRect(box_points);
+	roi = cv::Rect(roi.x - margin, roi.y - margin, roi.width + 2 * margin, roi.height + 2 * margin);
+	roi = roi & cv::Rect(0, 0, frame.cols, frame.rows);
+	if (roi.empty()) {
+		throw std::runtime_error("Boxes are outside the frame");
+	}
+
+	std::cout << "Caching " << frame_numbers.size() << " frames, region " << roi.x << "," << roi.y << " " << roi.width << "x" << roi.height << "\n";
+
+	FrameCacheWriter writer(output_path, roi, frame_numbers);
+	writer.append(frame);
+	for (size_t i = 1; i < frame_numbers.size(); ++i) {
+		writer.append(readFrame(frame_numbers[i]));
+	}
+
+	return 0;
+}
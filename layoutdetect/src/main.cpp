@@ -0,0 +1,222 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <array>
+#include <optional>
+
+#include <opencv2/opencv.hpp>
+
+struct Box {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+// Connected bright region that looks like a single cell
+struct Cell {
+	cv::Point2f centre;
+	cv::Size2f size;
+};
+
+static float median(std::vector<float> values) {
+	if (values.empty()) return 0.0f;
+	auto mid = values.begin() + values.size() / 2;
+	std::nth_element(values.begin(), mid, values.end());
+	return *mid;
+}
+
+// Groups sorted positions that are closer than gap to the previous one, returns the mean of each group
+static std::vector<float> clusterPositions(std::vector<float> positions, float gap) {
+	std::sort(positions.begin(), positions.end());
+	std::vector<float> res{};
+	float sum = 0.0f;
+	int count = 0;
+	for (size_t i = 0; i < positions.size(); ++i) {
+		if (count > 0 && positions[i] - positions[i - 1] > gap) {
+			res.push_back(sum / count);
+			sum = 0.0f;
+			count = 0;
+		}
+		sum += positions[i];
+		++count;
+	}
+	if (count > 0) {
+		res.push_back(sum / count);
+	}
+	return res;
+}
+
+static int nearestIndex(const std::vector<float>& positions, float p) {
+	int best = 0;
+	for (int i = 1; i < (int)positions.size(); ++i) {
+		if (std::abs(positions[i] - p) < std::abs(positions[best] - p)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+// Finds the lit cells of a calibration frame: every cell white on a dark background, or a
+// checkerboard of cells. Each 4-connected bright region is a candidate, so checkerboard squares
+// that only touch at their corners stay separate. Regions far from the typical cell size or
+// shape (noise, merged cells, the screen border) are dropped.
+static std::vector<Cell> detectCells(const cv::Mat& image, int min_cell_area, float min_fill) {
+	cv::Mat gray, binary;
+	cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+	cv::GaussianBlur(gray, gray, cv::Size(5, 5), 0);
+	cv::threshold(gray, binary, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+	cv::morphologyEx(binary, binary, cv::MORPH_OPEN, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3)));
+
+	cv::Mat labels, stats, centroids;
+	const int count = cv::connectedComponentsWithStats(binary, labels, stats, centroids, 4, CV_32S);
+
+	std::vector<Cell> candidates{};
+	// label 0 is the background
+	for (int i = 1; i < count; ++i) {
+		const int w = stats.at<int>(i, cv::CC_STAT_WIDTH);
+		const int h = stats.at<int>(i, cv::CC_STAT_HEIGHT);
+		const int area = stats.at<int>(i, cv::CC_STAT_AREA);
+		if (area < min_cell_area || (float)area < min_fill * w * h) continue;
+		candidates.push_back({ cv::Point2f((float)centroids.at<double>(i, 0), (float)centroids.at<double>(i, 1)), cv::Size2f((float)w, (float)h) });
+	}
+
+	std::vector<float> widths{}, heights{};
+	for (const auto& c : candidates) {
+		widths.push_back(c.size.width);
+		heights.push_back(c.size.height);
+	}
+	const float cell_w = median(widths);
+	const float cell_h = median(heights);
+
+	std::vector<Cell> cells{};
+	for (const auto& c : candidates) {
+		if (std::abs(c.size.width - cell_w) > 0.5f * cell_w || std::abs(c.size.height - cell_h) > 0.5f * cell_h) continue;
+		cells.push_back(c);
+	}
+	return cells;
+}
+
+int main()
+{
+	std::string video_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\layout.mkv";
+	// frame showing every cell lit, or a checkerboard of cells
+	constexpr int LAYOUT_FRAME = 100;
+
+	// Boxes are written in screen coordinates for the decoders that map them through the screen's corners
+	// (calibratetext, text_decoder2, ...), the frame is rectified with the corners first. Without it
+	// they're in frame coordinates, as simple_decoder uses them.
+	constexpr bool RECTIFY = true;
+	std::array<cv::Point2f, 4> corners{ // order topleft, topright, bottomleft, bottomright
+		cv::Point2f(61.8f, 24.2f),
+		cv::Point2f(2054.0f, -36.4f),
+		cv::Point2f(71.0f, 1087.6f),
+		cv::Point2f(2050.8f, 1129.1f),
+	};
+	const cv::Size screen_size(1920, 1080);
+
+	// Regions smaller than this, or filling less of their bounding box, aren't cells
+	constexpr int MIN_CELL_AREA = 16;
+	constexpr float MIN_FILL = 0.6f;
+	// Every cell of the grid spanned by the detected rows and columns is written, not only the lit ones.
+	// Needed for a checkerboard, and fills in cells that weren't detected.
+	constexpr bool FILL_GRID = true;
+	// Fraction of the cell trimmed off each side, keeps sampling away from blur and bleed at the edges
+	constexpr float EDGE_MARGIN = 0.15f;
+
+	std::string bboxes_path = "bboxes_detected.csv";
+	std::string mask_path = "mask_detected.png";
+	std::string overlay_path = "layout_overlay.png";
+
+	cv::VideoCapture cap(video_path);
+	if (!cap.isOpened()) {
+		throw std::runtime_error("Error: Could not open video");
+	}
+	cv::Mat frame;
+	cap.set(cv::CAP_PROP_POS_FRAMES, LAYOUT_FRAME);
+	if (!cap.read(frame)) {
+		throw std::runtime_error("Failed to read frame");
+	}
+
+	cv::Mat image = frame;
+	if (RECTIFY) {
+		std::array<cv::Point2f, 4> screen_corners{};
+		screen_corners[0] = cv::Point2f(0, 0);
+		screen_corners[1] = cv::Point2f((float)screen_size.width - 1, 0);
+		screen_corners[2] = cv::Point2f(0, (float)screen_size.height - 1);
+		screen_corners[3] = cv::Point2f((float)screen_size.width - 1, (float)screen_size.height - 1);
+		cv::Mat H = cv::findHomography(screen_corners, corners);
+		cv::warpPerspective(frame, image, H, screen_size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP);
+	}
+
+	auto cells = detectCells(image, MIN_CELL_AREA, MIN_FILL);
+	if (cells.empty()) {
+		throw std::runtime_error("No cells found in the layout frame");
+	}
+
+	std::vector<float> widths{}, heights{}, xs{}, ys{};
+	for (const auto& c : cells) {
+		widths.push_back(c.size.width);
+		heights.push_back(c.size.height);
+		xs.push_back(c.centre.x);
+		ys.push_back(c.centre.y);
+	}
+	const float cell_w = median(widths);
+	const float cell_h = median(heights);
+	// cells in the same column or row are well within half a cell of each other
+	const auto columns = clusterPositions(xs, cell_w / 2);
+	const auto rows = clusterPositions(ys, cell_h / 2);
+
+	// grid position -> detected cell centre, cells without one sit on their row and column
+	std::vector<std::vector<std::optional<cv::Point2f>>> grid(rows.size(), std::vector<std::optional<cv::Point2f>>(columns.size()));
+	for (const auto& c : cells) {
+		grid[nearestIndex(rows, c.centre.y)][nearestIndex(columns, c.centre.x)] = c.centre;
+	}
+
+	const float box_w = cell_w * (1.0f - 2.0f * EDGE_MARGIN);
+	const float box_h = cell_h * (1.0f - 2.0f * EDGE_MARGIN);
+	std::vector<Box> boxes{};
+	// raster order, the order the decoders assign symbols to boxes
+	for (size_t row = 0; row < rows.size(); ++row) {
+		for (size_t column = 0; column < columns.size(); ++column) {
+			const auto& detected = grid[row][column];
+			if (!detected && !FILL_GRID) continue;
+			const cv::Point2f centre = detected ? *detected : cv::Point2f(columns[column], rows[row]);
+			// clipped to the image, edge cells (and filled ones past the edge) would otherwise go off it.
+			// Every box stays at least a pixel so the raster order the decoders rely on is kept.
+			const int x0 = std::clamp((int)std::lround(centre.x - box_w / 2), 0, image.cols - 1);
+			const int y0 = std::clamp((int)std::lround(centre.y - box_h / 2), 0, image.rows - 1);
+			const int x1 = std::clamp((int)std::lround(centre.x + box_w / 2), x0 + 1, image.cols);
+			const int y1 = std::clamp((int)std::lround(centre.y + box_h / 2), y0 + 1, image.rows);
+			boxes.push_back({ x0, y0, x1 - x0, y1 - y0 });
+		}
+	}
+
+	std::ofstream bboxes_file(bboxes_path);
+	if (!bboxes_file) {
+		throw std::runtime_error("Failed to create file for writing");
+	}
+	bboxes_file << "x,y,w,h\n";
+	for (const auto& box : boxes) {
+		bboxes_file << box.x << "," << box.y << "," << box.w << "," << box.h << "\n";
+	}
+
+	// the decoders sample where the mask's green channel is 255
+	cv::Mat mask(image.size(), CV_8UC3, cv::Scalar(0, 0, 0));
+	cv::Mat overlay = image.clone();
+	for (const auto& box : boxes) {
+		const cv::Rect r(box.x, box.y, box.w, box.h);
+		cv::rectangle(mask, r, cv::Scalar(0, 255, 0), -1);
+		cv::rectangle(overlay, r, cv::Scalar(0, 0, 255), 1);
+	}
+	cv::imwrite(mask_path, mask);
+	cv::imwrite(overlay_path, overlay);
+
+	std::cout << "Found " << cells.size() << " cells in a " << columns.size() << "x" << rows.size()
+		<< " grid, wrote " << boxes.size() << " boxes to " << bboxes_path << "\n";
+
+	return 0;
+}
@@ -0,0 +1,428 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <array>
+#include <bit>
+#include <memory>
+
+#include <opencv2/opencv.hpp>
+
+#include "chunked_writer.h"
+#include "palette_tracker.h"
+#include "box_sampling.h"
+#include "closest_match.h"
+#include "section_layout.h"
+
+struct Box {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+static std::vector<Box> loadCsvBoxes(const std::string& filename) {
+	std::vector<Box> boxes;
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + filename);
+	}
+
+	std::string line;
+
+	// Skip header line
+	if (!std::getline(file, line)) {
+		return boxes; // empty file
+	}
+
+	// Parse data lines
+	while (std::getline(file, line)) {
+		if (line.empty()) continue;
+
+		std::stringstream ss(line);
+		std::string token;
+		Box b;
+
+		// Extract 4 integer columns
+		if (std::getline(ss, token, ',')) b.x = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.y = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.w = std::stoi(token);
+		if (std::getline(ss, token, ',')) b.h = std::stoi(token);
+
+		boxes.push_back(b);
+	}
+
+	return boxes;
+}
+
+static cv::Vec3b averageColor(std::span<const cv::Vec3b> colors) {
+	if (colors.empty()) return cv::Vec3b{ 0, 0, 0 };
+	cv::Vec3i sum{};
+	for (const auto& col : colors) {
+		sum[0] += col[0];
+		sum[1] += col[1];
+		sum[2] += col[2];
+	}
+	cv::Vec3b res{};
+	res[0] = static_cast<uchar>((sum[0] + colors.size() / 2) / colors.size());
+	res[1] = static_cast<uchar>((sum[1] + colors.size() / 2) / colors.size());
+	res[2] = static_cast<uchar>((sum[2] + colors.size() / 2) / colors.size());
+	return res;
+}
+
+// Averages the sampled pixels of every box into its section, in one pass over the boxes.
+template <std::size_t N>
+static std::array<cv::Vec3b, N> sampleSections(
+	const cv::Mat& frame,
+	const std::vector<std::vector<cv::Point>>& box_sample_points,
+	const std::array<int, BOX_COUNT>& box_sections)
+{
+	std::array<cv::Vec3i, N> sums{};
+	std::array<int, N> counts{};
+	for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+		const int section_index = box_sections[box_index];
+		cv::Vec3i sum{};
+		for (const cv::Point& p : box_sample_points[box_index]) {
+			const cv::Vec3b& col = frame.ptr<cv::Vec3b>(p.y)[p.x];
+			sum[0] += col[0];
+			sum[1] += col[1];
+			sum[2] += col[2];
+		}
+		sums[section_index] += sum;
+		counts[section_index] += (int)box_sample_points[box_index].size();
+	}
+
+	std::array<cv::Vec3b, N> res{};
+	for (std::size_t i = 0; i < N; ++i) {
+		if (counts[i] == 0) continue;
+		res[i][0] = static_cast<uchar>((sums[i][0] + counts[i] / 2) / counts[i]);
+		res[i][1] = static_cast<uchar>((sums[i][1] + counts[i] / 2) / counts[i]);
+		res[i][2] = static_cast<uchar>((sums[i][2] + counts[i] / 2) / counts[i]);
+	}
+	return res;
+}
+
+enum class RegionMode {
+	Colors, // average colour of every box, like text_decoder
+	Text,   // 8 sections x 8 levels, three characters per frame, like text_decoder2
+};
+
+// One screen (or one part of a screen) seen by the camera
+struct RegionConfig {
+	std::string name;
+	RegionMode mode;
+	std::string bboxes_path;
+	std::string mask_path;
+	int start_frame;
+	int frame_step;
+	int frame_count;
+	int calibration_start_frame; // Text only: LEVEL_COUNT frames, 2 * frame_step apart
+	std::array<cv::Point2f, 4> corners; // order topleft, topright, bottomleft, bottomright
+};
+
+// regions.csv, one region per line after the header:
+// name,mode,bboxes,mask,start_frame,frame_step,frame_count,calibration_start_frame,x0,y0,x1,y1,x2,y2,x3,y3
+static std::vector<RegionConfig> loadRegions(const std::string& filename) {
+	std::vector<RegionConfig> regions;
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + filename);
+	}
+
+	std::string line;
+
+	// Skip header line
+	if (!std::getline(file, line)) {
+		return regions; // empty file
+	}
+
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') continue;
+
+		std::stringstream ss(line);
+		std::vector<std::string> tokens{};
+		std::string token;
+		while (std::getline(ss, token, ',')) {
+			tokens.push_back(token);
+		}
+		if (tokens.size() != 16) {
+			throw std::runtime_error("Expected 16 columns in region: " + line);
+		}
+
+		RegionConfig r{};
+		r.name = tokens[0];
+		if (tokens[1] == "colors") {
+			r.mode = RegionMode::Colors;
+		}
+		else if (tokens[1] == "text") {
+			r.mode = RegionMode::Text;
+		}
+		else {
+			throw std::runtime_error("Unknown region mode: " + tokens[1]);
+		}
+		r.bboxes_path = tokens[2];
+		r.mask_path = tokens[3];
+		r.start_frame = std::stoi(tokens[4]);
+		r.frame_step = std::stoi(tokens[5]);
+		r.frame_count = std::stoi(tokens[6]);
+		r.calibration_start_frame = std::stoi(tokens[7]);
+		// frames are picked by dividing by the step
+		if (r.frame_step <= 0 || r.frame_count <= 0) {
+			throw std::runtime_error("frame_step and frame_count must be positive in region: " + line);
+		}
+		for (int i = 0; i < 4; ++i) {
+			r.corners[i] = cv::Point2f(std::stof(tokens[8 + i * 2]), std::stof(tokens[9 + i * 2]));
+		}
+
+		regions.push_back(r);
+	}
+
+	return regions;
+}
+
+// Decodes one region into its own output files. All the geometry is worked out up front,
+// so process() only reads the shared frame and touches this region's state, and
+// different regions can be processed at the same time.
+class RegionDecoder {
+public:
+	RegionDecoder(const RegionConfig& config, cv::Size frame_size)
+		: m_config(config)
+	{
+		cv::Mat mask = cv::imread(config.mask_path);
+		if (mask.empty()) {
+			throw std::runtime_error("Failed to read mask image: " + config.mask_path);
+		}
+
+		auto boxes = loadCsvBoxes(config.bboxes_path);
+		if (config.mode == RegionMode::Text && boxes.size() != BOX_COUNT) {
+			throw std::runtime_error("Text region " + config.name + " needs " + std::to_string(BOX_COUNT) + " boxes");
+		}
+		if (config.mode == RegionMode::Text && calibrationFrame(LEVEL_COUNT - 1) >= config.start_frame) {
+			throw std::runtime_error("Text region " + config.name + " must be calibrated before it's decoded");
+		}
+
+		std::array<cv::Point2f, 4> srcPnts{};
+		srcPnts[0] = cv::Point2f(0, 0);
+		srcPnts[1] = cv::Point2f(1919, 0);
+		srcPnts[2] = cv::Point2f(0, 1079);
+		srcPnts[3] = cv::Point2f(1919, 1079);
+		cv::Mat H = cv::findHomography(srcPnts, config.corners);
+		cv::Mat H_inv = H.inv();
+
+		std::vector<std::array<cv::Point2f, 4>> transformed_boxes{};
+		for (const auto& box : boxes) {
+			std::vector<cv::Point2f> srcPnts{};
+			std::vector<cv::Point2f> dstPnts{};
+
+			srcPnts.push_back(cv::Point2f(box.x, box.y));
+			srcPnts.push_back(cv::Point2f(box.x + box.w, box.y));
+			srcPnts.push_back(cv::Point2f(box.x, box.y + box.h));
+			srcPnts.push_back(cv::Point2f(box.x + box.w, box.y + box.h));
+			cv::perspectiveTransform(srcPnts, dstPnts, H);
+			transformed_boxes.push_back(std::array<cv::Point2f, 4>{
+				dstPnts[0], dstPnts[1], dstPnts[2], dstPnts[3]
+			});
+		}
+
+		m_box_sample_points = computeBoxSamplePoints(transformed_boxes, mask, H_inv, frame_size);
+
+		if (config.mode == RegionMode::Colors) {
+			m_output = std::make_unique<ChunkedWriter>(config.name + "_colors.csv", config.name + "_colors_chunks.csv");
+			m_output->writeHeader("r,g,b\n");
+		}
+		else {
+			m_output = std::make_unique<ChunkedWriter>(config.name + "_text.txt", config.name + "_text_chunks.csv");
+		}
+	}
+
+	const std::string& name() const { return m_config.name; }
+	int errors() const { return m_errors; }
+
+	int firstFrame() const
+	{
+		return m_config.mode == RegionMode::Text ? calibrationFrame(0) : m_config.start_frame;
+	}
+
+	int lastFrame() const
+	{
+		return m_config.start_frame + (m_config.frame_count - 1) * m_config.frame_step;
+	}
+
+	bool wants(int frame_index) const
+	{
+		return calibrationLevel(frame_index) >= 0 || decodeSymbol(frame_index) >= 0;
+	}
+
+	void process(int frame_index, const cv::Mat& frame)
+	{
+		if (const int level = calibrationLevel(frame_index); level >= 0) {
+			auto section_colors = sampleSections<SECTION_COUNT>(frame, m_box_sample_points, BOX_SECTIONS);
+			for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+				m_palettes[section_index][level] = section_colors[section_index];
+			}
+			if (level == LEVEL_COUNT - 1) {
+				for (auto& palette : m_palettes) {
+					m_trackers.emplace_back(palette, DRIFT_ALPHA, DRIFT_MAX_DISTANCE_RATIO);
+				}
+			}
+			return;
+		}
+
+		if (decodeSymbol(frame_index) < 0) return;
+
+		if (m_config.mode == RegionMode::Colors) {
+			std::string rows{};
+			for (const auto& points : m_box_sample_points) {
+				std::vector<cv::Vec3b> colors{};
+				for (const cv::Point& p : points) {
+					colors.push_back(frame.ptr<cv::Vec3b>(p.y)[p.x]);
+				}
+				cv::Vec3b color = averageColor(colors);
+				rows += std::to_string((int)color[2]) + "," + std::to_string((int)color[1]) + "," + std::to_string((int)color[0]) + "\n";
+			}
+			m_output->writeChunk(rows);
+			return;
+		}
+
+		char c1{}, c2{}, c3{};
+		bool p1{}, p2{}, p3{};
+
+		auto section_colors = sampleSections<SECTION_COUNT>(frame, m_box_sample_points, BOX_SECTIONS);
+		for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+			auto match = lookupMatchFromColor(m_palettes[section_index], section_colors[section_index]);
+			m_trackers[section_index].update(match, section_colors[section_index]);
+			int best_index = match.index;
+
+			if (section_index < 7) {
+				if (((best_index >> 0) & 1) == 1) {
+					c1 |= (1 << section_index);
+				}
+				if (((best_index >> 1) & 1) == 1) {
+					c2 |= (1 << section_index);
+				}
+				if (((best_index >> 2) & 1) == 1) {
+					c3 |= (1 << section_index);
+				}
+			}
+			else {
+				p1 = ((best_index >> 0) & 1) == 1;
+				p2 = ((best_index >> 1) & 1) == 1;
+				p3 = ((best_index >> 2) & 1) == 1;
+			}
+		}
+
+		// check parity of each char
+		const std::array<char, 3> chars{ c1, c2, c3 };
+		const std::array<bool, 3> parities{ p1, p2, p3 };
+		int chunk_errors = 0;
+		for (int j = 0; j < 3; ++j) {
+			if ((std::popcount(static_cast<unsigned char>(chars[j])) & 1) != parities[j]) {
+				++chunk_errors;
+			}
+		}
+		m_errors += chunk_errors;
+
+		m_output->writeChunk(std::string_view(chars.data(), chars.size()), chunk_errors);
+	}
+
+private:
+	// Palette drift tracking, see PaletteTracker. 0 disables it, around 0.05 follows slow lighting changes
+	static constexpr float DRIFT_ALPHA = 0.0f;
+	static constexpr float DRIFT_MAX_DISTANCE_RATIO = 0.5f;
+
+	int calibrationFrame(int level) const
+	{
+		return m_config.calibration_start_frame + level * 2 * m_config.frame_step;
+	}
+
+	// -1 if frame_index isn't a calibration frame
+	int calibrationLevel(int frame_index) const
+	{
+		if (m_config.mode != RegionMode::Text) return -1;
+		int offset = frame_index - m_config.calibration_start_frame;
+		if (offset < 0 || offset % (2 * m_config.frame_step) != 0 || offset / (2 * m_config.frame_step) >= LEVEL_COUNT) return -1;
+		return offset / (2 * m_config.frame_step);
+	}
+
+	// -1 if frame_index isn't a decode frame
+	int decodeSymbol(int frame_index) const
+	{
+		int offset = frame_index - m_config.start_frame;
+		if (offset < 0 || offset % m_config.frame_step != 0 || offset / m_config.frame_step >= m_config.frame_count) return -1;
+		return offset / m_config.frame_step;
+	}
+
+	RegionConfig m_config;
+	std::vector<std::vector<cv::Point>> m_box_sample_points{};
+	std::unique_ptr<ChunkedWriter> m_output{};
+	std::array<std::array<cv::Vec3b, LEVEL_COUNT>, SECTION_COUNT> m_palettes{};
+	std::vector<PaletteTracker<LEVEL_COUNT>> m_trackers{};
+	int m_errors = 0;
+};
+
+int main()
+{
+	std::string video_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\shorttext.mkv";
+	std::string regions_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\regions.csv";
+
+	cv::VideoCapture cap(video_path);
+	if (!cap.isOpened()) {
+		throw std::runtime_error("Error: Could not open video");
+	}
+	const cv::Size frame_size((int)cap.get(cv::CAP_PROP_FRAME_WIDTH), (int)cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+
+	std::vector<std::unique_ptr<RegionDecoder>> regions{};
+	for (const auto& config : loadRegions(regions_path)) {
+		regions.push_back(std::make_unique<RegionDecoder>(config, frame_size));
+	}
+	if (regions.empty()) {
+		throw std::runtime_error("No regions in " + regions_path);
+	}
+
+	int first_frame = std::numeric_limits<int>::max();
+	int last_frame = 0;
+	for (const auto& region : regions) {
+		first_frame = std::min(first_frame, region->firstFrame());
+		last_frame = std::max(last_frame, region->lastFrame());
+	}
+
+	// One pass through the video for every region: frames nobody wants are only grabbed,
+	// wanted frames are decoded once and handed to all the regions that want them in parallel.
+	cap.set(cv::CAP_PROP_POS_FRAMES, first_frame);
+	cv::Mat frame;
+	std::vector<RegionDecoder*> active{};
+	for (int frame_index = first_frame; frame_index <= last_frame; ++frame_index) {
+		active.clear();
+		for (const auto& region : regions) {
+			if (region->wants(frame_index)) {
+				active.push_back(region.get());
+			}
+		}
+
+		if (active.empty()) {
+			if (!cap.grab()) {
+				throw std::runtime_error("Failed to read frame");
+			}
+			continue;
+		}
+
+		if (!cap.read(frame)) {
+			throw std::runtime_error("Failed to read frame");
+		}
+		cv::parallel_for_(cv::Range(0, (int)active.size()), [&](const cv::Range& range) {
+			for (int i = range.start; i < range.end; ++i) {
+				active[i]->process(frame_index, frame);
+			}
+			});
+	}
+
+	for (const auto& region : regions) {
+		std::cout << region->name() << " errors: " << region->errors() << "\n";
+	}
+
+	return 0;
+}
@@ -0,0 +1,247 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <array>
+#include <bit>
+#include <format>
+
+#include <opencv2/opencv.hpp>
+
+#include "entry_covariances.h"
+#include "section_layout.h"
+#include "rate_plan.h"
+
+// Calibration samples written by text_decoder2 (see its writeCalibrationSamples), samples[level] of every
+// section as the decoder measures it and of every box on its own
+struct CalibrationSamples {
+	std::array<std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>, SECTION_COUNT> sections{};
+	std::vector<std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>> boxes{};
+	std::vector<int> box_sections{};
+};
+
+static CalibrationSamples loadCalibrationSamples(const std::string& path) {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + path);
+	}
+
+	CalibrationSamples res{};
+	std::string line;
+	// Skip header line
+	std::getline(file, line);
+	while (std::getline(file, line)) {
+		if (line.empty()) continue;
+
+		std::stringstream ss(line);
+		std::vector<std::string> tokens{};
+		std::string token;
+		while (std::getline(ss, token, ',')) {
+			tokens.push_back(token);
+		}
+		if (tokens.size() != 7) {
+			throw std::runtime_error("Bad line in calibration samples " + path + ": " + line);
+		}
+		const int index = std::stoi(tokens[1]);
+		const int section_index = std::stoi(tokens[2]);
+		const int level = std::stoi(tokens[3]);
+		const cv::Vec3f color(std::stof(tokens[4]), std::stof(tokens[5]), std::stof(tokens[6]));
+		if (index < 0 || section_index < 0 || section_index >= SECTION_COUNT || level < 0 || level >= LEVEL_COUNT) {
+			throw std::runtime_error("Bad line in calibration samples " + path + ": " + line);
+		}
+
+		if (tokens[0] == "section") {
+			res.sections[section_index][level].push_back(color);
+		}
+		else if (tokens[0] == "box") {
+			if (res.boxes.size() <= (size_t)index) {
+				res.boxes.resize(index + 1);
+				res.box_sections.resize(index + 1, -1);
+			}
+			res.boxes[index][level].push_back(color);
+			res.box_sections[index] = section_index;
+		}
+		else {
+			throw std::runtime_error("Bad line in calibration samples " + path + ": " + line);
+		}
+	}
+
+	// one sample per level gives no estimate of the noise, every level would look perfectly separated
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		for (int level = 0; level < LEVEL_COUNT; ++level) {
+			if (res.sections[section_index][level].size() < 2) {
+				throw std::runtime_error(std::format("Section {} level {} has {} calibration samples in {}, at least 2 are needed "
+					"(run text_decoder2 with WRITE_CALIBRATION_SAMPLES)", section_index, level, res.sections[section_index][level].size(), path));
+			}
+		}
+	}
+	return res;
+}
+
+// Squared distance between two levels in units of their noise: the covariances are averaged, so
+// it's the separation a classifier between just these two levels sees
+static float levelSeparationSq(const cv::Vec3f& a, const cv::Matx33f& cov_a, const cv::Vec3f& b, const cv::Matx33f& cov_b) {
+	const cv::Vec3f d = a - b;
+	const cv::Matx33f inv_cov = ((cov_a + cov_b) * 0.5f).inv(cv::DECOMP_CHOLESKY);
+	return d.dot(inv_cov * d);
+}
+
+// Expected symbol error rate when only the levels in level_mask are sent, each equally often.
+// Each pair of levels with Gaussian noise is confused with probability Q(d / 2), summed over the other
+// levels (a union bound, so slightly pessimistic when several neighbours are close).
+static double symbolErrorRate(const std::array<std::array<float, LEVEL_COUNT>, LEVEL_COUNT>& separation_sq, unsigned level_mask) {
+	double sum = 0.0;
+	for (int a = 0; a < LEVEL_COUNT; ++a) {
+		if (!(level_mask & (1u << a))) continue;
+		for (int b = 0; b < LEVEL_COUNT; ++b) {
+			if (b == a || !(level_mask & (1u << b))) continue;
+			sum += 0.5 * std::erfc(std::sqrt(separation_sq[a][b]) / (2.0 * std::sqrt(2.0)));
+		}
+	}
+	return sum / std::popcount(level_mask);
+}
+
+struct LevelChoice {
+	unsigned level_mask = 0;
+	double error_rate = 1.0;
+};
+
+// The set of 2^bits calibration levels with the lowest expected symbol error rate
+static LevelChoice chooseLevels(const std::array<std::array<float, LEVEL_COUNT>, LEVEL_COUNT>& separation_sq, int bits) {
+	LevelChoice best{};
+	for (unsigned mask = 1; mask < (1u << LEVEL_COUNT); ++mask) {
+		if (std::popcount(mask) != (1 << bits)) continue;
+		const double error_rate = bits == 0 ? 0.0 : symbolErrorRate(separation_sq, mask);
+		if (best.level_mask == 0 || error_rate < best.error_rate) {
+			best = { mask, error_rate };
+		}
+	}
+	return best;
+}
+
+// Which chosen level carries each value. The levels are chained from the darkest, each followed by the
+// closest one left, and value v goes to chain position gray^-1(v). Neighbours in the chain are the ones
+// most likely confused, and Gray coding makes that a single bit error the decoder's parity can find.
+static std::vector<int> assignLevelValues(
+	const std::array<std::array<float, LEVEL_COUNT>, LEVEL_COUNT>& separation_sq,
+	const std::array<cv::Vec3f, LEVEL_COUNT>& means,
+	unsigned level_mask)
+{
+	std::vector<int> remaining{};
+	for (int level = 0; level < LEVEL_COUNT; ++level) {
+		if (level_mask & (1u << level)) {
+			remaining.push_back(level);
+		}
+	}
+
+	std::vector<int> chain{};
+	auto darkest = std::ranges::min_element(remaining, {}, [&](int level) { return means[level][0] + means[level][1] + means[level][2]; });
+	chain.push_back(*darkest);
+	remaining.erase(darkest);
+	while (!remaining.empty()) {
+		auto next = std::ranges::min_element(remaining, {}, [&](int level) { return separation_sq[chain.back()][level]; });
+		chain.push_back(*next);
+		remaining.erase(next);
+	}
+
+	std::vector<int> levels(chain.size());
+	for (int position = 0; position < (int)chain.size(); ++position) {
+		levels[position ^ (position >> 1)] = chain[position];
+	}
+	return levels;
+}
+
+// Mean of each level and the separation of every pair (see levelSeparationSq), from per level samples
+// (one colour per calibration frame)
+static std::array<std::array<float, LEVEL_COUNT>, LEVEL_COUNT> levelSeparations(
+	const std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>& samples,
+	float prior_samples,
+	float noise_floor,
+	std::array<cv::Vec3f, LEVEL_COUNT>& means)
+{
+	const auto covariances = estimateEntryCovariances(samples, prior_samples, noise_floor);
+	for (int level = 0; level < LEVEL_COUNT; ++level) {
+		means[level] = cv::Vec3f{};
+		for (const auto& c : samples[level]) {
+			means[level] += c;
+		}
+		if (!samples[level].empty()) {
+			means[level] *= 1.0f / samples[level].size();
+		}
+	}
+
+	std::array<std::array<float, LEVEL_COUNT>, LEVEL_COUNT> separation_sq{};
+	for (int a = 0; a < LEVEL_COUNT; ++a) {
+		for (int b = 0; b < LEVEL_COUNT; ++b) {
+			separation_sq[a][b] = a == b ? 0.0f : levelSeparationSq(means[a], covariances[a], means[b], covariances[b]);
+		}
+	}
+	return separation_sq;
+}
+
+// Most bits whose best set of levels keeps the expected symbol error rate within target, at least 0
+static LevelChoice chooseRate(const std::array<std::array<float, LEVEL_COUNT>, LEVEL_COUNT>& separation_sq, double target, int max_bits, int& bits) {
+	for (bits = max_bits; bits > 0; --bits) {
+		const auto choice = chooseLevels(separation_sq, bits);
+		if (choice.error_rate <= target) {
+			return choice;
+		}
+	}
+	return chooseLevels(separation_sq, 0);
+}
+
+int main()
+{
+	// written by text_decoder2 with WRITE_CALIBRATION_SAMPLES, so the rates are estimated from exactly the section
+	// colours it classifies (with its box weights and sample level)
+	std::string calibration_samples_path = "calibration_samples.csv";
+
+	std::string rate_plan_path = "rate_plan.csv";
+	// every box on its own, to see which parts of the screen are good or bad
+	std::string box_rates_path = "box_rates.csv";
+
+	// Each section gets the most bits (of 3, all 8 levels) whose expected symbol error rate is within
+	// TARGET_SYMBOL_ERROR, down to 0 bits for a section that can't even separate two levels reliably
+	constexpr double TARGET_SYMBOL_ERROR = 1e-4;
+	constexpr int MAX_BITS = 3;
+	// noise estimation, as text_decoder2's GAUSSIAN_CLASSIFIER
+	constexpr float NOISE_PRIOR_SAMPLES = 4.0f;
+	constexpr float NOISE_FLOOR = 1.0f;
+
+	const auto samples = loadCalibrationSamples(calibration_samples_path);
+
+	RatePlan plan{};
+	int total_bits = 0;
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		std::array<cv::Vec3f, LEVEL_COUNT> means{};
+		const auto separation_sq = levelSeparations(samples.sections[section_index], NOISE_PRIOR_SAMPLES, NOISE_FLOOR, means);
+		int bits = 0;
+		const auto choice = chooseRate(separation_sq, TARGET_SYMBOL_ERROR, MAX_BITS, bits);
+		plan[section_index] = { bits, assignLevelValues(separation_sq, means, choice.level_mask) };
+		total_bits += bits;
+		std::cout << "Section " << section_index << ": " << bits << " bits, expected symbol error rate " << choice.error_rate << "\n";
+	}
+	saveRatePlan(rate_plan_path, plan);
+
+	std::ofstream box_rates_file(box_rates_path);
+	if (!box_rates_file) {
+		throw std::runtime_error("Failed to create file for writing");
+	}
+	box_rates_file << "box,section,bits,symbol_error_rate\n";
+	for (int box_index = 0; box_index < (int)samples.boxes.size(); ++box_index) {
+		if (samples.box_sections[box_index] < 0) continue;
+		std::array<cv::Vec3f, LEVEL_COUNT> means{};
+		const auto separation_sq = levelSeparations(samples.boxes[box_index], NOISE_PRIOR_SAMPLES, NOISE_FLOOR, means);
+		int bits = 0;
+		const auto choice = chooseRate(separation_sq, TARGET_SYMBOL_ERROR, MAX_BITS, bits);
+		box_rates_file << box_index << "," << samples.box_sections[box_index] << "," << bits << "," << choice.error_rate << "\n";
+	}
+
+	std::cout << total_bits << " bits per symbol (" << SECTION_COUNT * MAX_BITS << " with every section at "
+		<< MAX_BITS << "), wrote " << rate_plan_path << " and " << box_rates_path << "\n";
+
+	return 0;
+}
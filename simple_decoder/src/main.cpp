@@ -9,6 +9,9 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "chunked_writer.h"
+#include "debug_output.h"
+
 struct Box {
 	int x;
 	int y;
@@ -85,12 +88,85 @@ static auto saveVectorAsImage(const std::vector<cv::Vec3b>& pixels, int width, i
 	return img;
 }
 
+// Average masked colour of every box from an integral image: one pass over the area the boxes cover
+// per frame, then four lookups per box, so dense layouts (see layoutdetect) with thousands of boxes
+// cost little more than the 109 box one. Gives the same averages as visiting each box's pixels.
+class IntegralBoxSampler {
+public:
+	IntegralBoxSampler(const std::vector<Box>& boxes, const cv::Mat& mask)
+	{
+		for (const auto& box : boxes) {
+			m_roi |= cv::Rect(box.x, box.y, box.w, box.h);
+		}
+		m_roi &= cv::Rect(0, 0, mask.cols, mask.rows);
+
+		// sampled where the mask's green channel is 255
+		cv::Mat green;
+		cv::extractChannel(mask(m_roi), green, 1);
+		cv::compare(green, 255, m_mask, cv::CMP_EQ);
+
+		cv::Mat mask_sums;
+		cv::integral(m_mask / 255, mask_sums, CV_32S);
+		for (const auto& box : boxes) {
+			const cv::Rect r = (cv::Rect(box.x, box.y, box.w, box.h) & m_roi) - m_roi.tl();
+			m_boxes.push_back(r);
+			m_counts.push_back(r.area() > 0 ? rectSum<int>(mask_sums, r) : 0);
+		}
+	}
+
+	// average colour of each box, in order
+	void sample(const cv::Mat& frame, std::vector<cv::Vec3b>& colors)
+	{
+		m_masked.create(m_roi.size(), CV_8UC3);
+		m_masked.setTo(cv::Scalar::all(0));
+		frame(m_roi).copyTo(m_masked, m_mask);
+		cv::integral(m_masked, m_sums, CV_32S);
+
+		colors.resize(m_boxes.size());
+		for (size_t i = 0; i < m_boxes.size(); ++i) {
+			const int count = m_counts[i];
+			if (count == 0) {
+				colors[i] = cv::Vec3b{ 0, 0, 0 };
+				continue;
+			}
+			const cv::Vec3i sum = rectSum<cv::Vec3i>(m_sums, m_boxes[i]);
+			colors[i][0] = static_cast<uchar>((sum[0] + count / 2) / count);
+			colors[i][1] = static_cast<uchar>((sum[1] + count / 2) / count);
+			colors[i][2] = static_cast<uchar>((sum[2] + count / 2) / count);
+		}
+	}
+
+private:
+	template <typename T>
+	static T rectSum(const cv::Mat& sums, const cv::Rect& r)
+	{
+		return sums.at<T>(r.y + r.height, r.x + r.width) - sums.at<T>(r.y, r.x + r.width)
+			- sums.at<T>(r.y + r.height, r.x) + sums.at<T>(r.y, r.x);
+	}
+
+	cv::Rect m_roi{};
+	cv::Mat m_mask{};
+	std::vector<cv::Rect> m_boxes{};
+	std::vector<int> m_counts{};
+	cv::Mat m_masked{};
+	cv::Mat m_sums{};
+};
+
 int main()
 {
 	std::string video_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\mandrill_conv.mkv";
 	std::string bboxes_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\bboxes.csv";
 	std::string mask_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\mask2.png";
 
+	// Decoded images are also written here (directory or .avi/.mp4) by a background thread
+	constexpr bool DEBUG_OUTPUT = false;
+	std::string debug_output_path = "debug";
+
+	DebugOutput debug_output{};
+	if (DEBUG_OUTPUT) {
+		debug_output.open(debug_output_path);
+	}
+
 	cv::VideoCapture cap(video_path);
 	if (!cap.isOpened()) {
 		throw std::runtime_error("Error: Could not open video");
@@ -104,12 +180,37 @@ int main()
 	auto boxes = loadCsvBoxes(bboxes_path);
 
 	std::array<int, 1> START_FRAMES{ 562 };
-	constexpr int FRAME_COUNT = 151;
 
-	std::vector<cv::Vec3b> bitmap_pixels{};
+	// size of the transmitted image, it's sent in raster order one pixel per box
+	constexpr int IMAGE_WIDTH = 128;
+	constexpr int IMAGE_HEIGHT = 128;
+	const int FRAME_COUNT = (IMAGE_WIDTH * IMAGE_HEIGHT + (int)boxes.size() - 1) / (int)boxes.size();
+
+	// Average the boxes through an integral image rather than pixel by pixel, see IntegralBoxSampler
+	constexpr bool INTEGRAL_SAMPLING = true;
+	IntegralBoxSampler integral_sampler(boxes, mask);
+	std::vector<cv::Vec3b> box_colors{};
 
 	cv::Mat frame;
 	for (int START_FRAME : START_FRAMES) {
+		cv::Mat img(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC3, cv::Scalar(0, 0, 0));
+		int pixel_count = 0;
+
+		// binary ppm, each row is written out as soon as all its pixels are decoded
+		ChunkedWriter ppm_output(std::format("testpattern{}.ppm", START_FRAME), std::format("testpattern{}_chunks.csv", START_FRAME));
+		ppm_output.writeHeader(std::format("P6\n{} {}\n255\n", IMAGE_WIDTH, IMAGE_HEIGHT));
+		auto writeRow = [&](int y) {
+			std::string row(IMAGE_WIDTH * 3, '\0');
+			for (int x = 0; x < IMAGE_WIDTH; ++x) {
+				const cv::Vec3b& px = img.at<cv::Vec3b>(y, x);
+				// ppm is RGB
+				row[x * 3 + 0] = px[2];
+				row[x * 3 + 1] = px[1];
+				row[x * 3 + 2] = px[0];
+			}
+			ppm_output.writeChunk(row);
+		};
+
 		for (int i = 0; i < FRAME_COUNT; ++i) {
 			cap.set(cv::CAP_PROP_POS_FRAMES, START_FRAME + (i * 24));
 			bool ret = cap.read(frame);
@@ -117,29 +218,56 @@ int main()
 				throw std::runtime_error("Failed to read frame");
 			}
 
-			for (const auto& box : boxes) {
-				std::vector<cv::Vec3b> colors{};
-				for (int y = box.y; y < box.y + box.h; ++y) {
-					for (int x = box.x; x < box.x + box.w; ++x) {
-						auto test = mask.at<cv::Vec3b>(y, x);
-						if (mask.at<cv::Vec3b>(y, x)[1] == 255) {
-							colors.push_back(frame.at<cv::Vec3b>(y, x));
+			if (INTEGRAL_SAMPLING) {
+				integral_sampler.sample(frame, box_colors);
+			}
+
+			for (size_t box_index = 0; box_index < boxes.size(); ++box_index) {
+				const auto& box = boxes[box_index];
+				// pixels past the end of the image are padding
+				if (pixel_count >= IMAGE_WIDTH * IMAGE_HEIGHT) {
+					break;
+				}
+
+				cv::Vec3b color{};
+				if (INTEGRAL_SAMPLING) {
+					color = box_colors[box_index];
+				}
+				else {
+					std::vector<cv::Vec3b> colors{};
+					for (int y = box.y; y < box.y + box.h; ++y) {
+						for (int x = box.x; x < box.x + box.w; ++x) {
+							auto test = mask.at<cv::Vec3b>(y, x);
+							if (mask.at<cv::Vec3b>(y, x)[1] == 255) {
+								colors.push_back(frame.at<cv::Vec3b>(y, x));
+							}
 						}
 					}
-				}
 
-				// compute average
-				bitmap_pixels.push_back(averageColor(colors));
+					// compute average
+					color = averageColor(colors);
+				}
+				img.at<cv::Vec3b>(pixel_count / IMAGE_WIDTH, pixel_count % IMAGE_WIDTH) = color;
+				++pixel_count;
+				if (pixel_count % IMAGE_WIDTH == 0) {
+					writeRow(pixel_count / IMAGE_WIDTH - 1);
+				}
 			}
 		}
-		bitmap_pixels.resize(16384);
+
+		// remaining rows weren't transmitted, leave them black
+		for (int y = pixel_count / IMAGE_WIDTH; y < IMAGE_HEIGHT; ++y) {
+			writeRow(y);
+		}
+
 		std::string name = std::format("testpattern{}.png", START_FRAME);
-		auto img = saveVectorAsImage(bitmap_pixels, 128, 128, name);
-		cv::namedWindow(name, cv::WINDOW_NORMAL);
-		cv::resizeWindow(name, cv::Size{ 512, 512 });
-		cv::imshow(name, img);
+		cv::imwrite(name, img);
+		debug_output.submit(std::format("testpattern{}", START_FRAME), [img = img.clone()] {
+			cv::Mat out;
+			cv::resize(img, out, cv::Size{ 512, 512 }, 0, 0, cv::INTER_NEAREST);
+			return out;
+			});
 	}
-	cv::waitKey();
 
 	return 0;
 }
\ No newline at end of file
@@ -6,9 +6,21 @@
 #include <cmath>
 #include <span>
 #include <array>
+#include <filesystem>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 #include <opencv2/opencv.hpp>
 
+#include "chunked_writer.h"
+#include "palette_tracker.h"
+#include "closest_match.h"
+#include "box_sampling.h"
+#include "debug_output.h"
+
 struct Box {
 	int x;
 	int y;
@@ -50,21 +62,6 @@ static std::vector<Box> loadCsvBoxes(const std::string& filename) {
 	return boxes;
 }
 
-static cv::Vec3b averageColor(std::span<const cv::Vec3b> colors) {
-	if (colors.empty()) return cv::Vec3b{ 0, 0, 0 };
-	cv::Vec3i sum{};
-	for (const auto& col : colors) {
-		sum[0] += col[0];
-		sum[1] += col[1];
-		sum[2] += col[2];
-	}
-	cv::Vec3b res{};
-	res[0] = static_cast<uchar>((sum[0] + colors.size() / 2) / colors.size());
-	res[1] = static_cast<uchar>((sum[1] + colors.size() / 2) / colors.size());
-	res[2] = static_cast<uchar>((sum[2] + colors.size() / 2) / colors.size());
-	return res;
-}
-
 static auto saveVectorAsImage(const std::vector<cv::Vec3b>& pixels, int width, int height, const std::string& filename) {
 	if (pixels.size() != width * height) {
 		throw std::runtime_error("Pixel vector size does not match width * height");
@@ -86,52 +83,56 @@ static auto saveVectorAsImage(const std::vector<cv::Vec3b>& pixels, int width, i
 	return img;
 }
 
-static void pixelsInQuad(
-	const std::array<cv::Point2f, 4>& quad,
-	const cv::Mat& image,
-	std::function<void(int x, int y)> callback)
-{
-	// ---- 1. Compute bounding box ----
-	float minX = quad[0].x, maxX = quad[0].x;
-	float minY = quad[0].y, maxY = quad[0].y;
-
-	for (int i = 1; i < 4; ++i) {
-		minX = std::min(minX, quad[i].x);
-		maxX = std::max(maxX, quad[i].x);
-		minY = std::min(minY, quad[i].y);
-		maxY = std::max(maxY, quad[i].y);
-	}
-
-	// Clamp to image boundaries
-	int x0 = std::max(0, (int)std::floor(minX));
-	int x1 = std::min(image.cols - 1, (int)std::ceil(maxX));
-	int y0 = std::max(0, (int)std::floor(minY));
-	int y1 = std::min(image.rows - 1, (int)std::ceil(maxY));
-
-	// ---- 2. Prepare polygon for pointPolygonTest ----
-	std::vector<cv::Point2f> polygon(quad.begin(), quad.end());
-
-	// ---- 3. Loop through bounding box ----
-	for (int y = y0; y <= y1; ++y) {
-		for (int x = x0; x <= x1; ++x) {
 
-			// Test pixel center
-			cv::Point2f p(x + 0.5f, y + 0.5f);
+// Progress saved every few frames so an interrupted run can carry on where it stopped
+struct DecodeCheckpoint {
+	std::string identity; // capture and settings it was saved for
+	int next_frame = 0;
+	ChunkedWriter::Position output{};
+};
 
-			// > 0 = inside, =0 = on edge, <0 = outside
-			if (cv::pointPolygonTest(polygon, p, false) >= 0) {
-				callback(x, y);
-			}
+static void saveCheckpoint(const std::string& path, const DecodeCheckpoint& checkpoint) {
+	// written next to the old one and renamed over it, so there's always a complete checkpoint on disk
+	const std::string tmp_path = path + ".tmp";
+	{
+		std::ofstream file(tmp_path);
+		if (!file) {
+			throw std::runtime_error("Failed to create file for writing");
 		}
+		file << "identity " << checkpoint.identity << "\n";
+		file << "next_frame " << checkpoint.next_frame << "\n";
+		file << "output " << checkpoint.output.offset << " " << checkpoint.output.chunks_offset << " " << checkpoint.output.chunk_index << "\n";
 	}
+	std::filesystem::rename(tmp_path, path);
 }
 
-static std::array<int, 2> lookupMaskCoordinate(int x, int y, const cv::Mat& H)
-{
-	std::vector<cv::Point2f> srcPnt{ cv::Point2f(x, y) };
-	std::vector<cv::Point2f> dstPnt{};
-	cv::perspectiveTransform(srcPnt, dstPnt, H);
-	return std::array<int, 2>{(int)roundf(dstPnt[0].x), (int)roundf(dstPnt[0].y)};
+static DecodeCheckpoint loadCheckpoint(const std::string& path) {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		throw std::runtime_error("Could not open file: " + path);
+	}
+
+	DecodeCheckpoint checkpoint{};
+	std::string key;
+	while (file >> key) {
+		if (key == "identity") {
+			file >> std::ws;
+			std::getline(file, checkpoint.identity);
+		}
+		else if (key == "next_frame") {
+			file >> checkpoint.next_frame;
+		}
+		else if (key == "output") {
+			file >> checkpoint.output.offset >> checkpoint.output.chunks_offset >> checkpoint.output.chunk_index;
+		}
+		else {
+			throw std::runtime_error("Unexpected '" + key + "' in checkpoint " + path);
+		}
+	}
+	if (!file.eof()) {
+		throw std::runtime_error("Checkpoint is incomplete: " + path);
+	}
+	return checkpoint;
 }
 
 int main()
@@ -140,6 +141,32 @@ int main()
 	std::string bboxes_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\bboxes.csv";
 	std::string mask_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\mask2.png";
 
+	// Sampled frames with the boxes drawn on are written here (directory or .avi/.mp4) by a background thread
+	constexpr bool DEBUG_OUTPUT = false;
+	std::string debug_output_path = "debug";
+
+	// Decode the text here rather than writing text_colors.csv for calibratetext: the 128 colour palettes are
+	// measured on the calibration segment of the same video, with the same sampling geometry, and every text
+	// frame is classified as soon as it's sampled. The output is text_output.txt, as from calibratetext.
+	constexpr bool FUSED_DECODE = false;
+	constexpr int CALIBRATION_START_FRAME = 928;
+	constexpr int CALIBRATION_COLORS = 128;
+
+	// Palette drift tracking, see PaletteTracker. 0 disables it, around 0.05 follows slow lighting changes
+	constexpr float DRIFT_ALPHA = 0.0f;
+	constexpr float DRIFT_MAX_DISTANCE_RATIO = 0.5f;
+
+	// Progress is saved every CHECKPOINT_FRAMES frames. If a run stops part way through, the next one carries on from there
+	// (recalibrating first when FUSED_DECODE)
+	constexpr bool RESUME = false;
+	constexpr int CHECKPOINT_FRAMES = 4;
+	std::string checkpoint_path = FUSED_DECODE ? "text_output.checkpoint" : "text_colors.checkpoint";
+
+	DebugOutput debug_output{};
+	if (DEBUG_OUTPUT) {
+		debug_output.open(debug_output_path);
+	}
+
 	cv::VideoCapture cap(video_path);
 	if (!cap.isOpened()) {
 		throw std::runtime_error("Error: Could not open video");
@@ -188,44 +215,100 @@ int main()
 	constexpr int START_FRAME{ 4499 };
 	constexpr int FRAME_COUNT = 29;
 
-	std::vector<cv::Vec3b> text_colors{};
+	const cv::Size frame_size((int)cap.get(cv::CAP_PROP_FRAME_WIDTH), (int)cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+	auto box_sample_points = computeBoxSamplePoints(transformed_boxes, mask, H_inv, frame_size);
+
+	// a checkpoint only applies to the capture and settings it was saved with
+	const std::string checkpoint_identity = std::format("video={} frame={}x{} bboxes={} mask={} start={} frames={} fused={} calibration={},{}",
+		video_path, frame_size.width, frame_size.height, bboxes_path, mask_path, START_FRAME, FRAME_COUNT,
+		FUSED_DECODE, CALIBRATION_START_FRAME, CALIBRATION_COLORS);
+
+	std::optional<DecodeCheckpoint> resume_from{};
+	if (RESUME && std::filesystem::exists(checkpoint_path)) {
+		resume_from = loadCheckpoint(checkpoint_path);
+		if (resume_from->identity != checkpoint_identity) {
+			std::cout << "Ignoring checkpoint " << checkpoint_path << ", it was saved for a different capture or configuration\n";
+			resume_from.reset();
+		}
+		else {
+			std::cout << "Resuming from frame " << resume_from->next_frame << "\n";
+		}
+	}
 
 	cv::Mat frame;
-	for (int i = 0; i < FRAME_COUNT; ++i) {
+
+	// one palette per box, entry i measured in the i-th calibration frame
+	std::vector<std::array<cv::Vec3b, CALIBRATION_COLORS>> palettes{};
+	std::vector<PaletteTracker<CALIBRATION_COLORS>> palette_trackers{};
+	if (FUSED_DECODE) {
+		palettes.resize(box_sample_points.size());
+		for (int i = 0; i < CALIBRATION_COLORS; ++i) {
+			cap.set(cv::CAP_PROP_POS_FRAMES, CALIBRATION_START_FRAME + (i * 24));
+			if (!cap.read(frame)) {
+				throw std::runtime_error("Failed to read frame");
+			}
+			auto box_colors = sampleBoxesRounded(frame, box_sample_points);
+			for (size_t box_index = 0; box_index < box_colors.size(); ++box_index) {
+				palettes[box_index][i] = box_colors[box_index];
+			}
+		}
+		for (auto& palette : palettes) {
+			palette_trackers.emplace_back(palette, DRIFT_ALPHA, DRIFT_MAX_DISTANCE_RATIO);
+		}
+	}
+
+	// one chunk of csv rows (or decoded characters) per frame, written as soon as the frame is sampled
+	const std::string output_path = FUSED_DECODE ? "text_output.txt" : "text_colors.csv";
+	const std::string chunks_path = FUSED_DECODE ? "text_output_chunks.csv" : "text_colors_chunks.csv";
+	ChunkedWriter csv_output = resume_from
+		? ChunkedWriter(output_path, chunks_path, resume_from->output)
+		: ChunkedWriter(output_path, chunks_path);
+	if (!resume_from && !FUSED_DECODE) {
+		csv_output.writeHeader("r,g,b\n");
+	}
+
+	for (int i = resume_from ? resume_from->next_frame : 0; i < FRAME_COUNT; ++i) {
 		cap.set(cv::CAP_PROP_POS_FRAMES, START_FRAME + (i * 24));
 		bool ret = cap.read(frame);
 		if (!ret) {
 			throw std::runtime_error("Failed to read frame");
 		}
 
-		for (const auto& box : transformed_boxes) {
-			std::vector<cv::Vec3b> colors{};
-			pixelsInQuad(box, frame, [&](int x, int y) {
-				auto coords = lookupMaskCoordinate(x, y, H_inv);
-				//std::cout << "test\n";
-				if (mask.at<cv::Vec3b>(coords[1], coords[0])[1] == 255) {
-					colors.push_back(frame.at<cv::Vec3b>(y, x));
+		auto box_colors = sampleBoxesRounded(frame, box_sample_points);
+		std::string rows{};
+		for (size_t box_index = 0; box_index < box_colors.size(); ++box_index) {
+			const cv::Vec3b& color = box_colors[box_index];
+			if (FUSED_DECODE) {
+				auto match = findClosestMatch(color, palettes[box_index]);
+				palette_trackers[box_index].update(match, color);
+				rows.push_back((char)match.index);
+			}
+			else {
+				rows += std::to_string((int)color[2]) + "," + std::to_string((int)color[1]) + "," + std::to_string((int)color[0]) + "\n";
+			}
+		}
+		csv_output.writeChunk(rows);
+
+		if (debug_output.enabled()) {
+			debug_output.submit(std::format("frame{:06}", START_FRAME + (i * 24)), [transformed_boxes, frame = frame.clone()] {
+				cv::Mat out = frame.clone();
+				for (const auto& box : transformed_boxes) {
+					cv::line(out, box[0], box[1], cv::Scalar(0, 255, 0), 2);
+					cv::line(out, box[1], box[3], cv::Scalar(0, 255, 0), 2);
+					cv::line(out, box[3], box[2], cv::Scalar(0, 255, 0), 2);
+					cv::line(out, box[2], box[0], cv::Scalar(0, 255, 0), 2);
 				}
+				return out;
 				});
-
-			// compute average
-			text_colors.push_back(averageColor(colors));
 		}
-		//cv::imshow("winname", frame);
-		//cv::waitKey();
-	}
 
-	{
-		std::ofstream csv_output("text_colors.csv");
-		if (!csv_output) {
-			throw std::runtime_error("Failed to create file for writing");
-		}
-		csv_output << "r,g,b\n";
-		for (const auto& color : text_colors) {
-			csv_output << (int)color[2] << "," << (int)color[1] << "," << (int)color[0] << "\n";
+		if ((i + 1) % CHECKPOINT_FRAMES == 0) {
+			saveCheckpoint(checkpoint_path, { checkpoint_identity, i + 1, csv_output.position() });
 		}
 	}
-	cv::waitKey();
+
+	// finished, so the next run starts from scratch
+	std::filesystem::remove(checkpoint_path);
 
 	return 0;
 }
\ No newline at end of file
@@ -7,9 +7,36 @@
 #include <span>
 #include <array>
 #include <bit>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include <optional>
+#include <tuple>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #include <opencv2/opencv.hpp>
 
+#include "frame_cache.h"
+#include "chunked_writer.h"
+#include "palette_tracker.h"
+#include "payload_decoder.h"
+#include "debug_output.h"
+#include "box_sampling.h"
+#include "closest_match.h"
+#include "section_layout.h"
+#include "lens_model.h"
+#include "rate_plan.h"
+#include "decode_checkpoint.h"
+#include "entry_covariances.h"
+
 struct Box {
 	int x;
 	int y;
@@ -87,242 +114,848 @@ static auto saveVectorAsImage(const std::vector<cv::Vec3b>& pixels, int width, i
 	return img;
 }
 
-static void pixelsInQuad(
-	const std::array<cv::Point2f, 4>& quad,
-	const cv::Mat& image,
-	std::function<void(int x, int y)> callback)
+// Averages the sampled pixels of every box into its section, in one pass over the boxes.
+// Each box counts in proportion to its weight (see BoxQuality), boxes with no weight are skipped.
+template <std::size_t N>
+static std::array<cv::Vec3b, N> sampleSections(
+	const cv::Mat& frame,
+	const std::vector<std::vector<cv::Point>>& box_sample_points,
+	const std::array<int, BOX_COUNT>& box_sections,
+	const std::array<float, BOX_COUNT>& box_weights)
 {
-	// ---- 1. Compute bounding box ----
-	float minX = quad[0].x, maxX = quad[0].x;
-	float minY = quad[0].y, maxY = quad[0].y;
-
-	for (int i = 1; i < 4; ++i) {
-		minX = std::min(minX, quad[i].x);
-		maxX = std::max(maxX, quad[i].x);
-		minY = std::min(minY, quad[i].y);
-		maxY = std::max(maxY, quad[i].y);
+	std::array<cv::Vec3f, N> sums{};
+	std::array<float, N> counts{};
+	for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+		const float weight = box_weights[box_index];
+		if (weight <= 0.0f) continue;
+		const int section_index = box_sections[box_index];
+		cv::Vec3i sum{};
+		for (const cv::Point& p : box_sample_points[box_index]) {
+			const cv::Vec3b& col = frame.ptr<cv::Vec3b>(p.y)[p.x];
+			sum[0] += col[0];
+			sum[1] += col[1];
+			sum[2] += col[2];
+		}
+		sums[section_index][0] += weight * sum[0];
+		sums[section_index][1] += weight * sum[1];
+		sums[section_index][2] += weight * sum[2];
+		counts[section_index] += weight * box_sample_points[box_index].size();
 	}
 
-	// Clamp to image boundaries
-	int x0 = std::max(0, (int)std::floor(minX));
-	int x1 = std::min(image.cols - 1, (int)std::ceil(maxX));
-	int y0 = std::max(0, (int)std::floor(minY));
-	int y1 = std::min(image.rows - 1, (int)std::ceil(maxY));
+	std::array<cv::Vec3b, N> res{};
+	for (std::size_t i = 0; i < N; ++i) {
+		if (counts[i] <= 0.0f) continue;
+		res[i][0] = cv::saturate_cast<uchar>(sums[i][0] / counts[i]);
+		res[i][1] = cv::saturate_cast<uchar>(sums[i][1] / counts[i]);
+		res[i][2] = cv::saturate_cast<uchar>(sums[i][2] / counts[i]);
+	}
+	return res;
+}
 
-	// ---- 2. Prepare polygon for pointPolygonTest ----
-	std::vector<cv::Point2f> polygon(quad.begin(), quad.end());
+// Sample points on a copy of the frame shrunk by 2^level, only over roi (the part of the frame the
+// boxes cover). Each coarse pixel is the mean of a 2^level square of frame pixels, and a box only keeps
+// the coarse pixels whose whole square is in its full resolution sample points, so the mask still applies.
+struct SampleGeometry {
+	int level = 0;
+	cv::Rect roi{};
+	std::vector<std::vector<cv::Point>> points{};
+};
 
-	// ---- 3. Loop through bounding box ----
-	for (int y = y0; y <= y1; ++y) {
-		for (int x = x0; x <= x1; ++x) {
+static SampleGeometry downscaleSampleGeometry(const std::vector<std::vector<cv::Point>>& box_sample_points, int level, cv::Size image_size) {
+	const int scale = 1 << level;
 
-			// Test pixel center
-			cv::Point2f p(x + 0.5f, y + 0.5f);
+	int x0 = std::numeric_limits<int>::max(), y0 = std::numeric_limits<int>::max(), x1 = 0, y1 = 0;
+	for (const auto& points : box_sample_points) {
+		for (const cv::Point& p : points) {
+			x0 = std::min(x0, p.x);
+			y0 = std::min(y0, p.y);
+			x1 = std::max(x1, p.x + 1);
+			y1 = std::max(y1, p.y + 1);
+		}
+	}
 
-			// > 0 = inside, =0 = on edge, <0 = outside
-			if (cv::pointPolygonTest(polygon, p, false) >= 0) {
-				callback(x, y);
+	SampleGeometry res{};
+	res.level = level;
+	if (x0 >= x1) {
+		res.points.resize(box_sample_points.size());
+		return res;
+	}
+	// whole coarse pixels, inside the image
+	x0 -= x0 % scale;
+	y0 -= y0 % scale;
+	const int coarse_width = std::min((x1 - x0 + scale - 1) / scale, (image_size.width - x0) / scale);
+	const int coarse_height = std::min((y1 - y0 + scale - 1) / scale, (image_size.height - y0) / scale);
+	res.roi = cv::Rect(x0, y0, coarse_width * scale, coarse_height * scale);
+
+	for (const auto& points : box_sample_points) {
+		std::vector<cv::Point> coarse{};
+		for (const cv::Point& p : points) {
+			coarse.push_back(cv::Point((p.x - x0) >> level, (p.y - y0) >> level));
+		}
+		std::ranges::sort(coarse, [](const cv::Point& a, const cv::Point& b) { return a.y != b.y ? a.y < b.y : a.x < b.x; });
+
+		auto& box_points = res.points.emplace_back();
+		for (size_t i = 0; i < coarse.size();) {
+			size_t j = i;
+			while (j < coarse.size() && coarse[j] == coarse[i]) ++j;
+			if ((int)(j - i) == scale * scale && coarse[i].x < coarse_width && coarse[i].y < coarse_height) {
+				box_points.push_back(coarse[i]);
 			}
+			i = j;
+		}
+	}
+	return res;
+}
+
+// The image geometry's points index into: frame itself at level 0, otherwise its roi box filtered into buffer
+static const cv::Mat& downscaleFrame(const cv::Mat& frame, const SampleGeometry& geometry, cv::Mat& buffer) {
+	if (geometry.level == 0) {
+		return frame;
+	}
+	const int scale = 1 << geometry.level;
+	cv::resize(frame(geometry.roi), buffer, cv::Size(geometry.roi.width / scale, geometry.roi.height / scale), 0, 0, cv::INTER_AREA);
+	return buffer;
+}
+
+// Largest colour difference of any box between full resolution and downscaled sampling
+static float downscaleError(const std::vector<cv::Vec3f>& full, const std::vector<cv::Vec3f>& downscaled, const SampleGeometry& geometry) {
+	float res = 0.0f;
+	for (size_t box_index = 0; box_index < full.size(); ++box_index) {
+		if (geometry.points[box_index].empty()) {
+			return std::numeric_limits<float>::infinity();
 		}
+		res = std::max(res, (float)cv::norm(full[box_index] - downscaled[box_index]));
 	}
+	return res;
 }
 
-static std::array<int, 2> lookupMaskCoordinate(int x, int y, const cv::Mat& H)
+// How well a box separates the palette, measured on the calibration frames
+struct BoxQuality {
+	float separation = 0.0f;    // closest pair of levels: distance between their means / sum of their noise
+	float weight = 1.0f;        // share of the box in its section's average, 0 leaves it out
+	int calibration_errors = 0; // calibration samples the box on its own classifies as the wrong level
+};
+
+// samples[level]: the box's average colour in several frames showing that level
+static float boxSeparation(const std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>& samples) {
+	// below this the noise is quantisation, not the channel
+	constexpr float NOISE_FLOOR = 1.0f;
+
+	std::array<cv::Vec3f, LEVEL_COUNT> means{};
+	std::array<float, LEVEL_COUNT> noise{};
+	for (int level = 0; level < LEVEL_COUNT; ++level) {
+		const auto& s = samples[level];
+		if (s.empty()) continue;
+		cv::Vec3f sum{};
+		for (const auto& c : s) {
+			sum[0] += c[0];
+			sum[1] += c[1];
+			sum[2] += c[2];
+		}
+		means[level] = cv::Vec3f(sum[0] / s.size(), sum[1] / s.size(), sum[2] / s.size());
+
+		float sq = 0.0f;
+		for (const auto& c : s) {
+			const cv::Vec3f d(c[0] - means[level][0], c[1] - means[level][1], c[2] - means[level][2]);
+			sq += d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		}
+		noise[level] = std::sqrt(sq / s.size());
+	}
+
+	float separation = std::numeric_limits<float>::max();
+	for (int a = 0; a < LEVEL_COUNT; ++a) {
+		for (int b = a + 1; b < LEVEL_COUNT; ++b) {
+			const cv::Vec3f d(means[a][0] - means[b][0], means[a][1] - means[b][1], means[a][2] - means[b][2]);
+			const float dist = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+			separation = std::min(separation, dist / (noise[a] + noise[b] + NOISE_FLOOR));
+		}
+	}
+	return separation;
+}
+
+// Every calibration sample as the decoder measured it, so the rateplan tool estimates rates from the same colours.
+// calibration_samples.csv: a header line, then "kind,index,section,level,b,g,r" per sample, where kind is section
+// (weighted by the box weights at the chosen sample level, as the palettes are) or box (the box on its own).
+static void writeCalibrationSamples(
+	const std::string& path,
+	const std::array<std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>, SECTION_COUNT>& section_samples,
+	const std::vector<std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>>& box_samples)
 {
-	std::vector<cv::Point2f> srcPnt{ cv::Point2f(x, y) };
-	std::vector<cv::Point2f> dstPnt{};
-	cv::perspectiveTransform(srcPnt, dstPnt, H);
-	return std::array<int, 2>{(int)roundf(dstPnt[0].x), (int)roundf(dstPnt[0].y)};
+	std::ofstream file(path);
+	if (!file) {
+		throw std::runtime_error("Failed to create file for writing");
+	}
+
+	file << "kind,index,section,level,b,g,r\n";
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		for (int level = 0; level < LEVEL_COUNT; ++level) {
+			for (const auto& c : section_samples[section_index][level]) {
+				file << std::format("section,{},{},{},{:.3f},{:.3f},{:.3f}\n", section_index, section_index, level, c[0], c[1], c[2]);
+			}
+		}
+	}
+	for (int box_index = 0; box_index < (int)box_samples.size(); ++box_index) {
+		for (int level = 0; level < LEVEL_COUNT; ++level) {
+			for (const auto& c : box_samples[box_index][level]) {
+				file << std::format("box,{},{},{},{:.3f},{:.3f},{:.3f}\n", box_index, BOX_SECTIONS[box_index], level, c[0], c[1], c[2]);
+			}
+		}
+	}
 }
 
-static auto getSections()
+// Compact summary of where capacity is lost: per section quality and a confusion matrix of the
+// calibration samples, followed by every box.
+static void writeBoxQualityReport(
+	const std::string& path,
+	const std::vector<BoxQuality>& quality,
+	const std::array<std::array<int, LEVEL_COUNT>, LEVEL_COUNT>& confusion)
 {
-	std::array<std::vector<int>, 8> sections{};
-	sections[0] = {
-	0,
-	1,
-	2,
-	3,
-	4,
-	20,
-	21,
-	22,
-	23,
-	24,
-	25,
-	41,
-	42,
-	43,
-	44,
-	45,
-	46,
-	};
-	sections[1] = {
-	5,
-	6,
-	7,
-	8,
-	9,
-	10,
-	11,
-	12,
-	26,
-	27,
-	28,
-	29,
-	30,
-	31,
-	32,
-	33,
-	47,
-	48,
-	49,
-	50,
-	51,
-	52,
-	53,
-	73,
-	};
-	sections[2] = {
-	13,
-	14,
-	15,
-	34,
-	35,
-	36,
-	54,
-	55,
-	56,
-	};
-	sections[3] = {
-	16,
-	17,
-	18,
-	19,
-	37,
-	38,
-	39,
-	40,
-	57,
-	58,
-	59,
-	77,
-	};
-	sections[4] = {
-	60,
-	61,
-	62,
-	63,
-	64,
-	65,
-	78,
-	79,
-	80,
-	81,
-	82,
-	83,
-	95,
-	96,
-	97,
-	98,
-	};
-	sections[5] = {
-	66,
-	67,
-	68,
-	69,
-	70,
-	71,
-	72,
-	84,
-	85,
-	86,
-	87,
-	88,
-	89,
-	90,
-	99,
-	100,
-	101,
-	102,
-	};
-	sections[6] = {
-	91,
-	103,
-	104,
-	105,
-	};
-	sections[7] = {
-	74,
-	75,
-	76,
-	92,
-	93,
-	94,
-	106,
-	107,
-	108,
-	};
-	return sections;
+	std::ofstream file(path);
+	if (!file) {
+		throw std::runtime_error("Failed to create file for writing");
+	}
+
+	file << "section,boxes,excluded,min_separation,mean_separation,calibration_errors\n";
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		int excluded = 0, errors = 0;
+		float min_separation = std::numeric_limits<float>::max(), sum_separation = 0.0f;
+		for (const int box_index : SECTION_BOXES[section_index]) {
+			const auto& q = quality[box_index];
+			excluded += q.weight <= 0.0f;
+			errors += q.calibration_errors;
+			min_separation = std::min(min_separation, q.separation);
+			sum_separation += q.separation;
+		}
+		file << std::format("{},{},{},{:.2f},{:.2f},{}\n", section_index, SECTION_BOXES[section_index].size(), excluded,
+			min_separation, sum_separation / SECTION_BOXES[section_index].size(), errors);
+	}
+
+	file << "\nconfusion (rows: level shown, columns: level decoded)\n";
+	for (const auto& row : confusion) {
+		for (int level = 0; level < LEVEL_COUNT; ++level) {
+			file << (level ? "," : "") << row[level];
+		}
+		file << "\n";
+	}
+
+	file << "\nbox,section,separation,weight,calibration_errors\n";
+	for (int box_index = 0; box_index < (int)quality.size(); ++box_index) {
+		const auto& q = quality[box_index];
+		file << std::format("{},{},{:.2f},{:.2f},{}\n", box_index, BOX_SECTIONS[box_index], q.separation, q.weight, q.calibration_errors);
+	}
 }
 
-auto getIndexToSection(const std::array<std::vector<int>, 8>& sections) {
-	std::map<int, int> map{};
-	int section_index = 0;
-	for (const auto& section : sections) {
-		for (const int i : section) {
-			map.emplace(i, section_index);
+// Sum of absolute channel differences between the section colours of two frames
+template <std::size_t N>
+static int sectionsDifference(const std::array<cv::Vec3b, N>& a, const std::array<cv::Vec3b, N>& b) {
+	int diff = 0;
+	for (std::size_t i = 0; i < N; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			diff += std::abs(int(a[i][c]) - int(b[i][c]));
 		}
-		++section_index;
 	}
-	std::vector<int> res{};
-	for (const auto& [i, section_index] : map) {
-		res.push_back(section_index);
+	return diff;
+}
+
+// Frame to frame change of the section colours, change[t] is between frames t - 1 and t
+template <std::size_t N>
+static std::vector<double> sectionChanges(std::span<const std::array<cv::Vec3b, N>> colors) {
+	std::vector<double> change(colors.size(), 0.0);
+	for (std::size_t t = 1; t < colors.size(); ++t) {
+		change[t] = sectionsDifference(colors[t], colors[t - 1]);
 	}
-	return res;
+	return change;
 }
 
-static int lookupIndexFromColor(const std::vector<cv::Vec3b>& matching_colors, cv::Vec3b color) {
-	int bestIndex = -1;
-	int bestDist = std::numeric_limits<int>::max();
+// Of the frames every period apart, the phase with the largest average change, and that change
+static std::pair<double, int> bestSymbolPhase(const std::vector<double>& change, int period) {
+	double best_score = 0.0;
+	int best_phase = 0;
+	for (int phase = 0; phase < period; ++phase) {
+		double sum = 0.0;
+		int count = 0;
+		for (std::size_t t = phase + period; t < change.size(); t += period) {
+			sum += change[t];
+			++count;
+		}
+		if (count > 0 && sum / count > best_score) {
+			best_score = sum / count;
+			best_phase = phase;
+		}
+	}
+	return { best_score, best_phase };
+}
+
+// Finds the symbol period (in frames) and the phase of the symbol transitions from the section
+// colours of consecutive frames. Transitions show up as large frame to frame changes, so the
+// period/phase whose frames have the largest average change wins. Multiples of the real period
+// score about as well as it does, so the shortest period within 75% of the best is used.
+template <std::size_t N>
+static std::pair<int, int> detectSymbolPeriod(std::span<const std::array<cv::Vec3b, N>> colors, int min_period, int max_period) {
+	const auto change = sectionChanges(colors);
+
+	std::vector<std::tuple<double, int, int>> scores{}; // score, period, phase
+	double best_score = 0.0;
+	for (int period = min_period; period <= max_period; ++period) {
+		const auto [period_score, period_phase] = bestSymbolPhase(change, period);
+		scores.emplace_back(period_score, period, period_phase);
+		best_score = std::max(best_score, period_score);
+	}
+
+	if (best_score <= 0.0) {
+		throw std::runtime_error("No symbol transitions found, can't detect the symbol period");
+	}
+	for (const auto& [score, period, phase] : scores) {
+		if (score >= 0.75 * best_score) {
+			return { period, phase };
+		}
+	}
+	return { max_period, 0 };
+}
 
-	for (int i = 0; i < matching_colors.size(); ++i) {
-		const cv::Vec3b& c = matching_colors[i];
+// Phase of the symbol transitions when the period is already known, see detectSymbolPeriod
+template <std::size_t N>
+static int detectSymbolPhase(std::span<const std::array<cv::Vec3b, N>> colors, int period) {
+	return bestSymbolPhase(sectionChanges(colors), period).second;
+}
 
-		// Compute squared Euclidean distance
-		int db = int(c[0]) - int(color[0]);
-		int dg = int(c[1]) - int(color[1]);
-		int dr = int(c[2]) - int(color[2]);
+// Splits the boxes into band_count bands of frame rows by the height of their centre. A rolling shutter
+// reads the rows of a frame out one after another, so each band can see a symbol change at its own time.
+static std::array<int, BOX_COUNT> assignRowBands(const std::vector<std::array<cv::Point2f, 4>>& transformed_boxes, int band_count) {
+	std::array<float, BOX_COUNT> centres{};
+	for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+		const auto& box = transformed_boxes[box_index];
+		centres[box_index] = (box[0].y + box[1].y + box[2].y + box[3].y) / 4.0f;
+	}
+	const auto [top, bottom] = std::ranges::minmax(centres);
 
-		int dist = db * db + dg * dg + dr * dr;
+	std::array<int, BOX_COUNT> bands{};
+	for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+		if (bottom > top) {
+			bands[box_index] = std::min(band_count - 1, (int)((centres[box_index] - top) / (bottom - top) * band_count));
+		}
+	}
+	return bands;
+}
 
-		if (dist < bestDist) {
-			bestDist = dist;
-			bestIndex = i;
+// Section colours of the whole frame from those of each row band, each band counting in proportion
+// to how much of the section it samples (the same total weights sampleSections uses)
+template <std::size_t N>
+static std::array<cv::Vec3b, N> combineBandSections(std::span<const std::array<cv::Vec3b, N>> band_colors, std::span<const std::array<float, N>> band_weights) {
+	std::array<cv::Vec3f, N> sums{};
+	std::array<float, N> counts{};
+	for (std::size_t band = 0; band < band_colors.size(); ++band) {
+		for (std::size_t i = 0; i < N; ++i) {
+			const float weight = band_weights[band][i];
+			if (weight <= 0.0f) continue;
+			sums[i][0] += weight * band_colors[band][i][0];
+			sums[i][1] += weight * band_colors[band][i][1];
+			sums[i][2] += weight * band_colors[band][i][2];
+			counts[i] += weight;
 		}
 	}
 
-	if (bestIndex < 0) {
+	std::array<cv::Vec3b, N> res{};
+	for (std::size_t i = 0; i < N; ++i) {
+		if (counts[i] <= 0.0f) continue;
+		res[i][0] = cv::saturate_cast<uchar>(sums[i][0] / counts[i]);
+		res[i][1] = cv::saturate_cast<uchar>(sums[i][1] / counts[i]);
+		res[i][2] = cv::saturate_cast<uchar>(sums[i][2] / counts[i]);
+	}
+	return res;
+}
+
+// Picks the frame of a symbol to decode. Up to transition_frames frames at each end of the symbol
+// are rejected, they can show a partly updated display or be exposed across two symbols. Of the
+// rest, the frame that differs least from its neighbours is used.
+template <std::size_t N>
+static int selectSymbolFrame(std::span<const std::array<cv::Vec3b, N>> window, int transition_frames) {
+	const int size = (int)window.size();
+	const int guard = std::min(transition_frames, (size - 1) / 2);
+
+	int best_index = guard;
+	int best_score = std::numeric_limits<int>::max();
+	for (int t = guard; t < size - guard; ++t) {
+		int score = 0;
+		if (t > 0) score += sectionsDifference(window[t], window[t - 1]);
+		if (t + 1 < size) score += sectionsDifference(window[t], window[t + 1]);
+		if (score < best_score) {
+			best_score = score;
+			best_index = t;
+		}
+	}
+	return best_index;
+}
+
+// What classifying against a palette entry needs from its covariance
+struct EntryNoise {
+	cv::Matx33f inv_cov = cv::Matx33f::eye();
+	float log_det = 0.0f;
+};
+
+static EntryNoise entryNoise(const cv::Matx33f& cov) {
+	return { cov.inv(cv::DECOMP_CHOLESKY), (float)std::log(cv::determinant(cov)) };
+}
+
+// Finds the most likely palette entry for a colour, with every entry's measured colour modelled as a Gaussian
+// (see estimateEntryCovariances). Entries are ranked by the squared Mahalanobis distance plus the log determinant
+// of the entry's covariance, so with the same noise on every entry it ranks entries like findClosestMatch.
+// dist and second_dist are the plain squared Mahalanobis distances, so their ratio (ambiguity, drift tracking)
+// isn't skewed by the log determinant offsets.
+template <std::size_t N>
+static PaletteMatch gaussianPaletteMatch(std::span<const cv::Vec3b, N> palette, std::span<const EntryNoise, N> noise, const cv::Vec3b& color) {
+	PaletteMatch match{};
+	float best_score = std::numeric_limits<float>::max();
+	float second_score = std::numeric_limits<float>::max();
+
+	for (int i = 0; i < (int)palette.size(); ++i) {
+		const cv::Vec3f d((float)color[0] - palette[i][0], (float)color[1] - palette[i][1], (float)color[2] - palette[i][2]);
+		const float dist = d.dot(noise[i].inv_cov * d);
+		const float score = dist + noise[i].log_det;
+
+		if (score < best_score) {
+			second_score = best_score;
+			best_score = score;
+			match.second_dist = match.dist;
+			match.second_index = match.index;
+			match.dist = dist;
+			match.index = i;
+		}
+		else if (score < second_score) {
+			second_score = score;
+			match.second_dist = dist;
+			match.second_index = i;
+		}
+	}
+
+	if (match.index < 0) {
 		throw std::runtime_error("Couldn't find best index");
 	}
-	if (bestIndex > 7) {
-		throw std::runtime_error("bestIndex shouldn't be higher than 7");
+
+	return match;
+}
+
+// Like gaussianPaletteMatch (findClosestMatch when noise is empty) but only among the palette entries in
+// levels, for a section sending fewer levels (see RatePlan). The index is still the palette entry's.
+static PaletteMatch restrictedPaletteMatch(std::span<const cv::Vec3b> palette, std::span<const EntryNoise> noise, std::span<const int> levels, const cv::Vec3b& color) {
+	PaletteMatch match{};
+	float best_score = std::numeric_limits<float>::max();
+	float second_score = std::numeric_limits<float>::max();
+
+	for (const int i : levels) {
+		const cv::Vec3f d((float)color[0] - palette[i][0], (float)color[1] - palette[i][1], (float)color[2] - palette[i][2]);
+		const float dist = noise.empty() ? d.dot(d) : d.dot(noise[i].inv_cov * d);
+		const float score = noise.empty() ? dist : dist + noise[i].log_det;
+
+		if (score < best_score) {
+			second_score = best_score;
+			best_score = score;
+			match.second_dist = match.dist;
+			match.second_index = match.index;
+			match.dist = dist;
+			match.index = i;
+		}
+		else if (score < second_score) {
+			second_score = score;
+			match.second_dist = dist;
+			match.second_index = i;
+		}
+	}
+
+	if (match.index < 0) {
+		throw std::runtime_error("Couldn't find best index");
 	}
 
-	return bestIndex;  // index of the closest matching color
+	return match;
 }
 
+enum class RawPixelFormat {
+	BGR24,   // ffmpeg -pix_fmt bgr24
+	YUV420P, // ffmpeg -pix_fmt yuv420p
+};
+
+// Bounded frame queue between the stream reader and the decoder.
+// When full the oldest frame is dropped, so under overload the decoder
+// falls behind by at most `capacity` frames instead of growing without limit.
+class FrameQueue {
+public:
+	explicit FrameQueue(size_t capacity) : m_capacity(capacity) {}
+
+	void push(int frame_index, cv::Mat frame)
+	{
+		{
+			std::lock_guard lock(m_mutex);
+			if (m_frames.size() >= m_capacity) {
+				m_frames.pop_front();
+				++m_dropped;
+			}
+			m_frames.emplace_back(frame_index, std::move(frame));
+		}
+		m_cv.notify_one();
+	}
+
+	// blocks until a frame is available, returns false once closed and drained
+	bool pop(int& frame_index, cv::Mat& frame)
+	{
+		std::unique_lock lock(m_mutex);
+		m_cv.wait(lock, [&] { return !m_frames.empty() || m_closed; });
+		if (m_frames.empty()) {
+			return false;
+		}
+		frame_index = m_frames.front().first;
+		frame = std::move(m_frames.front().second);
+		m_frames.pop_front();
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard lock(m_mutex);
+			m_closed = true;
+		}
+		m_cv.notify_all();
+	}
+
+	size_t dropped() const
+	{
+		std::lock_guard lock(m_mutex);
+		return m_dropped;
+	}
+
+private:
+	const size_t m_capacity;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::deque<std::pair<int, cv::Mat>> m_frames{};
+	size_t m_dropped = 0;
+	bool m_closed = false;
+};
+
+// Reads fixed-size raw frames from stdin ("-") or a named pipe on a background thread,
+// e.g. `ffmpeg -i <capture> -f rawvideo -pix_fmt bgr24 - | text_decoder2`.
+// Only frames accepted by `wanted` are converted and queued, the rest are read and discarded.
+class RawFrameStream {
+public:
+	enum class ReadResult {
+		Ok,
+		Dropped,     // the requested frame was dropped from the queue
+		EndOfStream,
+	};
+
+	RawFrameStream(const std::string& path, cv::Size frame_size, RawPixelFormat format, size_t queue_capacity, std::function<bool(int)> wanted)
+		: m_frame_size(frame_size), m_format(format), m_queue(queue_capacity), m_wanted(std::move(wanted))
+	{
+		if (path == "-") {
+#ifdef _WIN32
+			_setmode(_fileno(stdin), _O_BINARY);
+#endif
+			m_file = stdin;
+		}
+		else {
+			m_file = std::fopen(path.c_str(), "rb");
+			if (!m_file) {
+				throw std::runtime_error("Could not open stream: " + path);
+			}
+		}
+		m_thread = std::thread([this] { readLoop(); });
+	}
+
+	RawFrameStream(const RawFrameStream&) = delete;
+	RawFrameStream& operator=(const RawFrameStream&) = delete;
+
+	~RawFrameStream()
+	{
+		m_stop = true;
+		m_queue.close();
+		m_thread.join();
+		if (m_file != stdin) {
+			std::fclose(m_file);
+		}
+	}
+
+	// Frames must be requested in increasing order as the stream can't seek.
+	// A frame later than the one requested is kept back for the next call.
+	ReadResult read(int frame_index, cv::Mat& frame)
+	{
+		while (true) {
+			if (!m_has_pending) {
+				if (!m_queue.pop(m_pending_index, m_pending_frame)) {
+					return ReadResult::EndOfStream;
+				}
+				m_has_pending = true;
+			}
+			if (m_pending_index < frame_index) {
+				m_has_pending = false;
+				continue;
+			}
+			if (m_pending_index > frame_index) {
+				return ReadResult::Dropped;
+			}
+			frame = std::move(m_pending_frame);
+			m_has_pending = false;
+			return ReadResult::Ok;
+		}
+	}
+
+	// index of the newest frame read from the stream
+	int latestFrameIndex() const { return m_latest_index; }
+
+	size_t droppedFrames() const { return m_queue.dropped(); }
+
+private:
+	void readLoop()
+	{
+		const size_t pixels = (size_t)m_frame_size.width * m_frame_size.height;
+		const size_t frame_bytes = (m_format == RawPixelFormat::BGR24) ? pixels * 3 : pixels * 3 / 2;
+		std::vector<uchar> buffer(frame_bytes);
+
+		for (int frame_index = 0; !m_stop; ++frame_index) {
+			if (std::fread(buffer.data(), 1, frame_bytes, m_file) != frame_bytes) {
+				break;
+			}
+			m_latest_index = frame_index;
+			if (!m_wanted(frame_index)) {
+				continue;
+			}
+
+			cv::Mat frame;
+			if (m_format == RawPixelFormat::BGR24) {
+				frame = cv::Mat(m_frame_size, CV_8UC3, buffer.data()).clone();
+			}
+			else {
+				cv::Mat yuv(m_frame_size.height * 3 / 2, m_frame_size.width, CV_8UC1, buffer.data());
+				cv::cvtColor(yuv, frame, cv::COLOR_YUV2BGR_I420);
+			}
+			m_queue.push(frame_index, std::move(frame));
+		}
+		m_queue.close();
+	}
+
+	const cv::Size m_frame_size;
+	const RawPixelFormat m_format;
+	FrameQueue m_queue;
+	std::function<bool(int)> m_wanted;
+	std::FILE* m_file = nullptr;
+	std::thread m_thread;
+	std::atomic<bool> m_stop = false;
+	std::atomic<int> m_latest_index = -1;
+
+	// only touched by the decoding thread
+	bool m_has_pending = false;
+	int m_pending_index = -1;
+	cv::Mat m_pending_frame{};
+};
+
 int main()
 {
 	std::string video_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\shorttext\\shorttext.mkv";
 	std::string bboxes_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\bboxes.csv";
 	std::string mask_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\mask2.png";
 
-	cv::VideoCapture cap(video_path);
-	if (!cap.isOpened()) {
-		throw std::runtime_error("Error: Could not open video");
+	// Live input: decode raw frames from stdin or a named pipe as they arrive instead of reading video_path
+	constexpr bool STREAM_INPUT = false;
+	std::string stream_path = "-";
+	constexpr int STREAM_WIDTH = 1920;
+	constexpr int STREAM_HEIGHT = 1080;
+	constexpr RawPixelFormat STREAM_FORMAT = RawPixelFormat::BGR24;
+	constexpr size_t STREAM_QUEUE_FRAMES = 8;
+
+	// Read pre-cropped frames from a cache built by the framecache tool instead of seeking in video_path:
+	// framecache shorttext.mkv bboxes.csv shorttext.roic --frames 1559:2:173 --frames 2425:24:246 --corners 61.8,24.2,2054,-36.4,71,1087.6,2050.8,1129.1
+	constexpr bool USE_FRAME_CACHE = false;
+	std::string frame_cache_path = "shorttext.roic";
+
+	// Overlays and decoded frames are rendered in the background to this directory (or .avi/.mp4)
+	constexpr bool DEBUG_OUTPUT = false;
+	std::string debug_output_path = "debug";
+
+	// The characters carry a compressed payload (see PayloadDecoder) rather than plain text
+	constexpr bool COMPRESSED_PAYLOAD = false;
+
+	// Send each section with the levels and bits of a rate plan (see RatePlan, written by the rateplan tool from the
+	// calibration samples below) instead of 8 levels everywhere with the last section carrying parity. Good sections
+	// then carry more bits and bad ones fewer. The transmitter has to send with the same plan.
+	constexpr bool RATE_PLAN = false;
+	std::string rate_plan_path = "rate_plan.csv";
+	// Write every calibration sample as measured for the rateplan tool. Each level is then sampled in QUALITY_FRAMES
+	// frames, the noise rateplan estimates needs more than one.
+	constexpr bool WRITE_CALIBRATION_SAMPLES = false;
+	std::string calibration_samples_path = "calibration_samples.csv";
+
+	// Decoder state is saved every CHECKPOINT_SYMBOLS symbols. If a run stops part way through, the next one
+	// carries on from the checkpoint without recalibrating (not with STREAM_INPUT, a stream can't go back,
+	// COMPRESSED_PAYLOAD, the decompressor's state isn't saved, or RATE_PLAN, characters straddle symbols)
+	constexpr bool RESUME = false;
+	constexpr int CHECKPOINT_SYMBOLS = 8;
+	std::string checkpoint_path = "text_output.checkpoint";
+
+	// Camera intrinsics/distortion for wide angle captures. The correction is folded into the
+	// sampling geometry, which is worked out once, so it costs nothing per frame.
+	// If lens_path doesn't exist it's estimated from the checkerboard captures and saved there.
+	constexpr bool LENS_CORRECTION = false;
+	std::string lens_path = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\camera.yml";
+	std::filesystem::path checkerboard_dir = "C:\\Users\\Bailey\\Documents\\University\\L4\\project\\Masters_Project\\bailey\\reception\\checkerboard";
+	const cv::Size CHECKERBOARD_SIZE(9, 6);
+
+	// Box quality: each calibration level is sampled in QUALITY_FRAMES frames, QUALITY_FRAME_SPACING apart,
+	// to measure how well every box separates the levels compared to its noise. Poorly separated boxes
+	// count less in their section (not at all below QUALITY_EXCLUDE), see box_quality.csv.
+	// Off by default, it reads QUALITY_FRAMES frames per level during calibration instead of one.
+	constexpr bool BOX_QUALITY = false;
+	constexpr int QUALITY_FRAMES = 5;
+	constexpr int QUALITY_FRAME_SPACING = 2;
+	constexpr float QUALITY_EXCLUDE = 2.0f;
+	constexpr float QUALITY_FULL_WEIGHT = 6.0f;
+	// A character failing parity is corrected by flipping the bit of its least certain section if that
+	// section is at least ERASURE_AMBIGUITY ambiguous (distance to the closest level / distance to the runner up).
+	// Off by default: when the error was in another section the flip adds a second one that parity can't see.
+	constexpr bool ERASURE_CORRECTION = false;
+	constexpr float ERASURE_AMBIGUITY = 0.6f;
+
+	// Classify each section colour by the most likely palette entry given the noise measured on the calibration
+	// frames (see gaussianPaletteMatch) instead of the nearest one. Needs CALIBRATION_SAMPLES > 1 to learn
+	// anything, with a single sample every entry gets the same NOISE_FLOOR spread and it's plain nearest match.
+	constexpr bool GAUSSIAN_CLASSIFIER = false;
+	constexpr float NOISE_PRIOR_SAMPLES = 4.0f;
+	constexpr float NOISE_FLOOR = 1.0f;
+
+	// Palette drift tracking, see PaletteTracker. 0 disables it, around 0.05 follows slow lighting changes
+	constexpr float DRIFT_ALPHA = 0.0f;
+	constexpr float DRIFT_MAX_DISTANCE_RATIO = 0.5f;
+
+	constexpr int SYMBOL_FRAMES = 24;
+	constexpr int CALIBRATION_START_FRAME = 1587 - SYMBOL_FRAMES;
+	constexpr int CALIBRATION_FRAME_STEP = 2 * SYMBOL_FRAMES;
+	constexpr int DECODE_START_FRAME = 2425;
+	constexpr int DECODE_FRAMES = 246;
+
+	// Sequential decoding processes every frame rather than seeking to one per symbol, so symbols can
+	// be much shorter than SYMBOL_FRAMES. The symbol period and phase are detected from DETECT_FRAMES
+	// frames around the start (or SYMBOL_FRAMES is used), transition frames are rejected and each
+	// symbol is decoded from its steadiest frame. Calibration frames are still found from SYMBOL_FRAMES.
+	constexpr bool SEQUENTIAL_DECODE = false;
+	constexpr bool DETECT_SYMBOL_PERIOD = true;
+	constexpr int MIN_SYMBOL_FRAMES = 3;
+	constexpr int MAX_SYMBOL_FRAMES = 48;
+	constexpr int DETECT_FRAMES = 480;
+	constexpr int TRANSITION_FRAMES = 1;
+	// Rolling shutter: the camera reads a frame's rows out one after another, so with short symbols the top and
+	// bottom of a frame can show different symbols. The boxes are split into ROW_BANDS bands of frame rows, the
+	// transition phase is detected for each band and each band is decoded from its own steadiest frame of the
+	// symbol. Sequential decoding only, one frame from the middle of a long symbol is steady in every row.
+	// Off by default, with symbols longer than a few frames it only adds per band phase detection work.
+	constexpr bool ROLLING_SHUTTER = false;
+	constexpr int ROW_BANDS = 4;
+
+	// Sample box colours from the frame shrunk by up to 2^MAX_SAMPLE_LEVEL (only the area the boxes cover).
+	// Calibration compares every level against full resolution and decodes with the coarsest one whose box
+	// colours are all within SAMPLE_LEVEL_TOLERANCE. Off by default, the tolerance is only checked against the
+	// calibration frames, not the lighting changes later in a capture.
+	constexpr bool DOWNSCALED_SAMPLING = false;
+	constexpr int MAX_SAMPLE_LEVEL = 2;
+	constexpr float SAMPLE_LEVEL_TOLERANCE = 1.5f;
+
+	constexpr int CALIBRATION_SAMPLES = BOX_QUALITY || WRITE_CALIBRATION_SAMPLES ? QUALITY_FRAMES : 1;
+	auto calibrationFrame = [](int level, int sample) {
+		return CALIBRATION_START_FRAME + level * CALIBRATION_FRAME_STEP + (sample - CALIBRATION_SAMPLES / 2) * QUALITY_FRAME_SPACING;
+	};
+	auto isCalibrationFrame = [&](int frame_index) {
+		for (int level = 0; level < LEVEL_COUNT; ++level) {
+			for (int sample = 0; sample < CALIBRATION_SAMPLES; ++sample) {
+				if (frame_index == calibrationFrame(level, sample)) {
+					return true;
+				}
+			}
+		}
+		return false;
+	};
+	auto isDecodeFrame = [](int frame_index) {
+		if (SEQUENTIAL_DECODE) {
+			return frame_index >= DECODE_START_FRAME - MAX_SYMBOL_FRAMES;
+		}
+		int offset = frame_index - DECODE_START_FRAME;
+		return offset >= 0 && offset % SYMBOL_FRAMES == 0 && offset / SYMBOL_FRAMES < DECODE_FRAMES;
+	};
+
+	DebugOutput debug_output{};
+	if (DEBUG_OUTPUT) {
+		debug_output.open(debug_output_path);
+	}
+
+	cv::VideoCapture cap{};
+	std::unique_ptr<RawFrameStream> stream{};
+	FrameCache frame_cache{};
+	cv::Size frame_size{};
+	// where pixel (0, 0) of a read frame is in the full frame
+	cv::Point frame_origin{};
+	if (STREAM_INPUT) {
+		frame_size = cv::Size(STREAM_WIDTH, STREAM_HEIGHT);
+		stream = std::make_unique<RawFrameStream>(stream_path, frame_size, STREAM_FORMAT, STREAM_QUEUE_FRAMES, [&](int frame_index) {
+			return isCalibrationFrame(frame_index) || isDecodeFrame(frame_index);
+			});
+	}
+	else if (USE_FRAME_CACHE) {
+		frame_cache.open(frame_cache_path);
+		// the cache covers every box so nothing past its bottom right corner is sampled
+		frame_size = cv::Size(frame_cache.roi().br());
+		frame_origin = frame_cache.roi().tl();
+	}
+	else {
+		cap.open(video_path);
+		if (!cap.isOpened()) {
+			throw std::runtime_error("Error: Could not open video");
+		}
+		frame_size = cv::Size((int)cap.get(cv::CAP_PROP_FRAME_WIDTH), (int)cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+	}
+
+	// a checkpoint only applies to the capture and settings it was saved with
+	const std::string checkpoint_identity = std::format(
+		"source={} frame={}x{} bboxes={} mask={} symbol_frames={} calibration={},{},{} decode={},{} sequential={} erasure={} box_quality={} lens={} downscaled={} gaussian={} rolling_shutter={}",
+		USE_FRAME_CACHE ? frame_cache_path : video_path, frame_size.width, frame_size.height, bboxes_path, mask_path,
+		SYMBOL_FRAMES, CALIBRATION_START_FRAME, CALIBRATION_FRAME_STEP, CALIBRATION_SAMPLES, DECODE_START_FRAME, DECODE_FRAMES,
+		SEQUENTIAL_DECODE, ERASURE_CORRECTION, BOX_QUALITY, LENS_CORRECTION, DOWNSCALED_SAMPLING, GAUSSIAN_CLASSIFIER, ROLLING_SHUTTER);
+
+	std::optional<DecodeCheckpoint> resume_from{};
+	if (RESUME && !STREAM_INPUT && !COMPRESSED_PAYLOAD && !RATE_PLAN && std::filesystem::exists(checkpoint_path)) {
+		resume_from = loadCheckpoint(checkpoint_path);
+		if (resume_from->identity != checkpoint_identity) {
+			std::cout << "Ignoring checkpoint " << checkpoint_path << ", it was saved for a different capture or configuration\n";
+			resume_from.reset();
+		}
+		else {
+			std::cout << "Resuming from symbol " << resume_from->next_symbol << "\n";
+		}
 	}
 
+	int next_video_frame = -1;
+	// Returns false if a streamed frame was dropped because the decoder fell behind
+	auto readFrame = [&](int frame_index, cv::Mat& frame) {
+		if (stream) {
+			auto res = stream->read(frame_index, frame);
+			if (res == RawFrameStream::ReadResult::EndOfStream) {
+				throw std::runtime_error("Stream ended before frame " + std::to_string(frame_index));
+			}
+			return res == RawFrameStream::ReadResult::Ok;
+		}
+		if (frame_cache.isOpen()) {
+			if (!frame_cache.frame(frame_index, frame)) {
+				throw std::runtime_error("Frame " + std::to_string(frame_index) + " is not in the frame cache");
+			}
+			return true;
+		}
+		// seeking is slow, don't when reading consecutive frames
+		if (frame_index != next_video_frame) {
+			cap.set(cv::CAP_PROP_POS_FRAMES, frame_index);
+		}
+		next_video_frame = frame_index + 1;
+		bool ret = cap.read(frame);
+		if (!ret) {
+			throw std::runtime_error("Failed to read frame");
+		}
+		return true;
+	};
+
 	cv::Mat mask = cv::imread(mask_path);
 	if (mask.empty()) {
 		throw std::runtime_error("Failed to read mask image");
@@ -330,6 +963,17 @@ int main()
 
 	auto boxes = loadCsvBoxes(bboxes_path);
 
+	LensModel lens{};
+	if (LENS_CORRECTION) {
+		if (std::filesystem::exists(lens_path)) {
+			lens = loadLensModel(lens_path);
+		}
+		else {
+			lens = estimateLensModel(checkerboard_dir, CHECKERBOARD_SIZE);
+			saveLensModel(lens_path, lens);
+		}
+	}
+
 #if 0
 	cv::Mat H = (cv::Mat_<double>(3, 3) <<
 		0.9429, 0.0060, 64.2086,
@@ -349,6 +993,11 @@ int main()
 	dstPnts[1] = cv::Point2f(2054, -36.4);
 	dstPnts[2] = cv::Point2f(71, 1087.6);
 	dstPnts[3] = cv::Point2f(2050.8, 1129.1);
+	if (lens.enabled()) {
+		// the corners are measured on the captured frame, the homography is between the screen and an ideal lens
+		auto undistorted = undistortPoints(std::vector<cv::Point2f>(dstPnts.begin(), dstPnts.end()), lens);
+		std::copy(undistorted.begin(), undistorted.end(), dstPnts.begin());
+	}
 	H = cv::findHomography(srcPnts, dstPnts);
 	cv::Mat H_inv = H.inv();
 #endif
@@ -370,45 +1019,175 @@ int main()
 		srcPnts.push_back(cv::Point2f(box.x, box.y + box.h));
 		srcPnts.push_back(cv::Point2f(box.x + box.w, box.y + box.h));
 		cv::perspectiveTransform(srcPnts, dstPnts, H);
+		if (lens.enabled()) {
+			dstPnts = distortPoints(dstPnts, lens);
+		}
 		transformed_boxes.push_back(std::array<cv::Point2f, 4>{
 			dstPnts[0], dstPnts[1], dstPnts[2], dstPnts[3]
 		});
 	}
 
-	auto sections = getSections();
-	auto index_to_sections = getIndexToSection(sections);
+	UndistortFunction undistort{};
+	if (lens.enabled()) {
+		undistort = [&](const std::vector<cv::Point2f>& points) { return undistortPoints(points, lens); };
+	}
+	auto box_sample_points = computeBoxSamplePoints(transformed_boxes, mask, H_inv, frame_size, undistort);
+	for (auto& points : box_sample_points) {
+		for (auto& point : points) {
+			point -= frame_origin;
+		}
+	}
+
+	// size of the frames readFrame returns
+	const cv::Size read_size(frame_size.width - frame_origin.x, frame_size.height - frame_origin.y);
+	std::vector<SampleGeometry> sample_geometries{};
+	sample_geometries.push_back(SampleGeometry{ 0, cv::Rect(cv::Point(0, 0), read_size), box_sample_points });
+	for (int level = 1; DOWNSCALED_SAMPLING && level <= MAX_SAMPLE_LEVEL; ++level) {
+		sample_geometries.push_back(downscaleSampleGeometry(box_sample_points, level, read_size));
+	}
+	int sample_level = 0;
 
 
 	// calibration
 
-	std::vector<std::vector<cv::Vec3b>> measured_colors_per_section(8);
-	{
-		constexpr int START_FRAME = 1587 - 24;
+	std::array<std::array<cv::Vec3b, LEVEL_COUNT>, SECTION_COUNT> measured_colors_per_section{};
+	std::array<std::array<cv::Matx33f, LEVEL_COUNT>, SECTION_COUNT> palette_covariances{};
+	std::array<float, BOX_COUNT> box_weights{};
+	box_weights.fill(1.0f);
+	std::vector<BoxQuality> box_quality(BOX_COUNT);
+	if (resume_from) {
+		measured_colors_per_section = resume_from->palettes;
+		box_weights = resume_from->box_weights;
+		sample_level = std::min(resume_from->sample_level, (int)sample_geometries.size() - 1);
+		palette_covariances = resume_from->covariances;
+	}
+	else {
+		// box_samples[box][level]: the box's average colour in each frame sampled for the level
+		std::vector<std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>> box_samples(BOX_COUNT);
+		// worst difference from full resolution seen at each sample level
+		std::vector<float> level_errors(sample_geometries.size(), 0.0f);
+		cv::Mat frame, downscaled;
+		for (int i = 0; i < LEVEL_COUNT; ++i) {
+			for (int sample = 0; sample < CALIBRATION_SAMPLES; ++sample) {
+				if (!readFrame(calibrationFrame(i, sample), frame)) {
+					throw std::runtime_error("Calibration frame was dropped");
+				}
 
-		cv::Mat frame;
-		for (int i = 0; i < 8; ++i) {
-			cap.set(cv::CAP_PROP_POS_FRAMES, START_FRAME + i * 48);
-			{
-				bool ret = cap.read(frame);
-				if (!ret) {
-					throw std::runtime_error("Failed to read frame");
+				auto box_colors = sampleBoxes(frame, box_sample_points);
+				for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+					box_samples[box_index][i].push_back(box_colors[box_index]);
+				}
+
+				for (size_t level = 1; level < sample_geometries.size(); ++level) {
+					const auto& geometry = sample_geometries[level];
+					auto downscaled_colors = sampleBoxes(downscaleFrame(frame, geometry, downscaled), geometry.points);
+					level_errors[level] = std::max(level_errors[level], downscaleError(box_colors, downscaled_colors, geometry));
 				}
 			}
+		}
 
-			for (int section_index = 0; section_index < 8; ++section_index) {
-				// find average colour
-				std::vector<cv::Vec3b> colors{};
-				for (const int box_index : sections[section_index]) {
-					pixelsInQuad(transformed_boxes[box_index], frame, [&](int x, int y) {
-						auto coords = lookupMaskCoordinate(x, y, H_inv);
-						//std::cout << "test\n";
-						if (mask.at<cv::Vec3b>(coords[1], coords[0])[1] == 255) {
-							colors.push_back(frame.at<cv::Vec3b>(y, x));
-						}
-						});
+		for (size_t level = 1; level < sample_geometries.size(); ++level) {
+			std::cout << "Sample level " << level << " error " << level_errors[level] << "\n";
+		}
+		// coarsest level before the first one that's too far off
+		while (sample_level + 1 < (int)sample_geometries.size() && level_errors[sample_level + 1] <= SAMPLE_LEVEL_TOLERANCE) {
+			++sample_level;
+		}
+		std::cout << "Sampling at 1/" << (1 << sample_level) << " resolution\n";
+
+		if (BOX_QUALITY) {
+			for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+				auto& q = box_quality[box_index];
+				q.separation = boxSeparation(box_samples[box_index]);
+				q.weight = q.separation < QUALITY_EXCLUDE ? 0.0f : std::min(1.0f, q.separation / QUALITY_FULL_WEIGHT);
+			}
+			// a section always keeps its boxes, even if they're all bad
+			for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+				const auto& section_boxes = SECTION_BOXES[section_index];
+				if (std::ranges::all_of(section_boxes, [&](int box_index) { return box_quality[box_index].weight <= 0.0f; })) {
+					for (const int box_index : section_boxes) {
+						box_quality[box_index].weight = 1.0f;
+					}
 				}
-				measured_colors_per_section[section_index].push_back(averageColor(colors));
 			}
+			for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+				box_weights[box_index] = box_quality[box_index].weight;
+			}
+		}
+
+		// each section's palette is the weighted average of its boxes over all the samples, like sampleSections
+		// at the chosen sample level. The section colour of each sample on its own gives the entry's noise.
+		std::array<std::array<std::vector<cv::Vec3f>, LEVEL_COUNT>, SECTION_COUNT> calibration_samples{};
+		for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+			auto& section_samples = calibration_samples[section_index];
+			for (int i = 0; i < LEVEL_COUNT; ++i) {
+				cv::Vec3f sum{};
+				float count = 0.0f;
+				std::vector<cv::Vec3f> sample_sums(CALIBRATION_SAMPLES);
+				float sample_count = 0.0f;
+				for (const int box_index : SECTION_BOXES[section_index]) {
+					const float weight = box_weights[box_index] * sample_geometries[sample_level].points[box_index].size();
+					for (size_t sample = 0; sample < box_samples[box_index][i].size(); ++sample) {
+						const auto& c = box_samples[box_index][i][sample];
+						sum[0] += weight * c[0];
+						sum[1] += weight * c[1];
+						sum[2] += weight * c[2];
+						count += weight;
+						sample_sums[sample] += c * weight;
+					}
+					sample_count += weight;
+				}
+				if (count <= 0.0f) continue;
+				measured_colors_per_section[section_index][i] = cv::Vec3b(
+					cv::saturate_cast<uchar>(sum[0] / count), cv::saturate_cast<uchar>(sum[1] / count), cv::saturate_cast<uchar>(sum[2] / count));
+				for (const auto& sample_sum : sample_sums) {
+					section_samples[i].push_back(sample_sum * (1.0f / sample_count));
+				}
+			}
+			palette_covariances[section_index] = estimateEntryCovariances(section_samples, NOISE_PRIOR_SAMPLES, NOISE_FLOOR);
+		}
+		if (WRITE_CALIBRATION_SAMPLES) {
+			writeCalibrationSamples(calibration_samples_path, calibration_samples, box_samples);
+		}
+
+		if (BOX_QUALITY) {
+			// how each box on its own would classify the calibration samples
+			std::array<std::array<int, LEVEL_COUNT>, LEVEL_COUNT> confusion{};
+			for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+				const auto& palette = measured_colors_per_section[BOX_SECTIONS[box_index]];
+				for (int i = 0; i < LEVEL_COUNT; ++i) {
+					for (const auto& c : box_samples[box_index][i]) {
+						const cv::Vec3b color(cv::saturate_cast<uchar>(c[0]), cv::saturate_cast<uchar>(c[1]), cv::saturate_cast<uchar>(c[2]));
+						const int decoded = lookupIndexFromColor(palette, color);
+						++confusion[i][decoded];
+						box_quality[box_index].calibration_errors += decoded != i;
+					}
+				}
+			}
+			writeBoxQualityReport("box_quality.csv", box_quality, confusion);
+
+			const auto excluded = std::ranges::count_if(box_quality, [](const BoxQuality& q) { return q.weight <= 0.0f; });
+			int calibration_errors = 0;
+			for (const auto& q : box_quality) {
+				calibration_errors += q.calibration_errors;
+			}
+			std::cout << "Box quality: " << excluded << " of " << BOX_COUNT << " boxes excluded, "
+				<< calibration_errors << " box calibration samples misclassified, see box_quality.csv\n";
+
+			// boxes outlined from red (excluded) to green (full weight)
+			debug_output.submit("box_quality", [=] {
+				cv::Mat out(frame_size, CV_8UC3, cv::Scalar(0, 0, 0));
+				for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+					const auto& box = transformed_boxes[box_index];
+					const float w = box_weights[box_index];
+					cv::Scalar color(0, 255 * w, 255 * (1.0f - w));
+					cv::line(out, box[0], box[1], color, 5);
+					cv::line(out, box[1], box[3], color, 5);
+					cv::line(out, box[3], box[2], color, 5);
+					cv::line(out, box[2], box[0], color, 5);
+				}
+				return out;
+				});
 		}
 		std::cout << "BREAK\n";
 	}
@@ -417,29 +1196,15 @@ int main()
 
 	// display calibration data
 
-	{
-
-		cap.set(cv::CAP_PROP_POS_FRAMES, 3360);
-		cv::Mat frame;
-		bool ret = cap.read(frame);
-		if (!ret) {
-			throw std::runtime_error("Failed to read frame");
-		}
-
-		cv::Mat out(1080, 1920, CV_8UC3);
-		for (int x = 0; x < 1920; ++x) {
-			for (int y = 0; y < 1080; ++y) {
-				auto& ref = out.at<cv::Vec3b>(y, x);
-				ref[0] = 0;
-				ref[1] = 0;
-				ref[2] = 0;
-			}
-		}
+	for (int j = 0; j < LEVEL_COUNT; ++j) {
+		cv::Scalar color = measured_colors_per_section[BOX_SECTIONS[0]][j];
+		std::cout << "color: " << color << "\n";
 
-		for (int j = 0; j < 8; ++j) {
+		debug_output.submit(std::format("calibration_level{}", j), [=] {
+			cv::Mat out(frame_size, CV_8UC3, cv::Scalar(0, 0, 0));
 			int i = 0;
 			for (const auto& box : transformed_boxes) {
-				int section_index = index_to_sections[i];
+				int section_index = BOX_SECTIONS[i];
 				cv::Scalar color = measured_colors_per_section[section_index][j];
 				cv::line(out, box[0], box[1], color, 5);
 				cv::line(out, box[1], box[3], color, 5);
@@ -447,48 +1212,301 @@ int main()
 				cv::line(out, box[2], box[0], color, 5);
 				++i;
 			}
-			cv::Scalar color = measured_colors_per_section[index_to_sections[0]][j];
-			std::cout << "color: " << color << "\n";
-			cv::imshow("out", out);
-			cv::waitKey();
-		}
+			return out;
+			});
 	}
 
 
 
+	std::vector<PaletteTracker<LEVEL_COUNT>> palette_trackers{};
+	for (auto& palette : measured_colors_per_section) {
+		palette_trackers.emplace_back(palette, DRIFT_ALPHA, DRIFT_MAX_DISTANCE_RATIO);
+	}
+
+	std::array<std::array<EntryNoise, LEVEL_COUNT>, SECTION_COUNT> palette_noise{};
+	for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+		for (int i = 0; i < LEVEL_COUNT; ++i) {
+			palette_noise[section_index][i] = entryNoise(palette_covariances[section_index][i]);
+		}
+	}
+	RatePlan rate_plan{};
+	// value of each level in the plan, -1 for levels a section doesn't use
+	std::array<std::array<int, LEVEL_COUNT>, SECTION_COUNT> level_values{};
+	if (RATE_PLAN) {
+		rate_plan = loadRatePlan(rate_plan_path);
+		int bits_per_symbol = 0;
+		for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+			level_values[section_index].fill(-1);
+			const auto& levels = rate_plan[section_index].levels;
+			for (int value = 0; value < (int)levels.size(); ++value) {
+				level_values[section_index][levels[value]] = value;
+			}
+			bits_per_symbol += rate_plan[section_index].bits;
+		}
+		std::cout << "Rate plan: " << bits_per_symbol << " bits per symbol\n";
+	}
+	// without erasure correction no bit is ever ambiguous enough to flip
+	PlanBitReader plan_bits(ERASURE_CORRECTION ? ERASURE_AMBIGUITY : std::numeric_limits<float>::infinity());
+
+	auto classifySection = [&](int section_index, const cv::Vec3b& color) {
+		if (RATE_PLAN) {
+			return restrictedPaletteMatch(measured_colors_per_section[section_index],
+				GAUSSIAN_CLASSIFIER ? std::span<const EntryNoise>(palette_noise[section_index]) : std::span<const EntryNoise>(),
+				rate_plan[section_index].levels, color);
+		}
+		if (GAUSSIAN_CLASSIFIER) {
+			return gaussianPaletteMatch(std::span<const cv::Vec3b, LEVEL_COUNT>(measured_colors_per_section[section_index]),
+				std::span<const EntryNoise, LEVEL_COUNT>(palette_noise[section_index]), color);
+		}
+		return lookupMatchFromColor(measured_colors_per_section[section_index], color);
+	};
+
 	// decode text
-	std::vector<char> output_text{};
-	std::vector<bool> parities{};
+	ChunkedWriter text_output = resume_from
+		? ChunkedWriter("text_output.txt", "text_output_chunks.csv", resume_from->output)
+		: ChunkedWriter("text_output.txt", "text_output_chunks.csv");
+	int errors = resume_from ? resume_from->errors : 0;
+	int corrected = resume_from ? resume_from->corrected : 0;
+	PayloadDecoder payload{};
+	int lost_symbols = resume_from ? resume_from->lost_symbols : 0;
+	int max_latency_frames = 0;
+
+	// every decoded frame is sampled at the level picked during calibration
+	const SampleGeometry& sampling = sample_geometries[sample_level];
+	cv::Mat downscaled_frame;
+	auto sampleFrameSections = [&](const cv::Mat& frame) {
+		return sampleSections<SECTION_COUNT>(downscaleFrame(frame, sampling, downscaled_frame), sampling.points, BOX_SECTIONS, box_weights);
+	};
+
+	// rolling shutter: each band samples only its own boxes, the section colours of the frame are put
+	// back together from the bands with how much of each section every band covers
+	const auto box_bands = assignRowBands(transformed_boxes, ROW_BANDS);
+	std::array<std::array<float, BOX_COUNT>, ROW_BANDS> band_box_weights{};
+	std::array<std::array<float, SECTION_COUNT>, ROW_BANDS> band_section_weights{};
+	for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+		const int band = box_bands[box_index];
+		band_box_weights[band][box_index] = box_weights[box_index];
+		band_section_weights[band][BOX_SECTIONS[box_index]] += box_weights[box_index] * sampling.points[box_index].size();
+	}
+	auto sampleFrameBands = [&](const cv::Mat& frame) {
+		const cv::Mat& sampled = downscaleFrame(frame, sampling, downscaled_frame);
+		std::array<std::array<cv::Vec3b, SECTION_COUNT>, ROW_BANDS> res{};
+		for (int band = 0; band < ROW_BANDS; ++band) {
+			res[band] = sampleSections<SECTION_COUNT>(sampled, sampling.points, BOX_SECTIONS, band_box_weights[band]);
+		}
+		return res;
+	};
+
+	// sequential decoding: section colours of each frame from sequential_base_frame on, sampled when first needed.
+	// Frames no later symbol can use are dropped as symbols are decoded, so this covers the detection frames and
+	// then about one symbol window plus the spread of the band offsets.
+	struct SequentialFrame {
+		bool read = false;
+		bool ok = false;  // false if the frame was dropped
+		std::array<cv::Vec3b, SECTION_COUNT> colors{};
+		std::array<std::array<cv::Vec3b, SECTION_COUNT>, ROW_BANDS> band_colors{};  // with ROLLING_SHUTTER
+		cv::Mat frame{};  // only kept for debug output, until its symbol is decoded
+	};
+	const int first_sequential_frame = DECODE_START_FRAME - MAX_SYMBOL_FRAMES;
+	std::deque<SequentialFrame> sequential_frames{};
+	int sequential_base_frame = first_sequential_frame;
+	bool keep_sequential_frames = false;
+	auto sequentialFrame = [&](int frame_index) -> SequentialFrame& {
+		if (frame_index < sequential_base_frame) {
+			throw std::runtime_error(std::format("Frame {} was needed after it was dropped", frame_index));
+		}
+		const size_t i = frame_index - sequential_base_frame;
+		if (sequential_frames.size() <= i) {
+			sequential_frames.resize(i + 1);
+		}
+		auto& entry = sequential_frames[i];
+		if (!entry.read) {
+			entry.read = true;
+			cv::Mat frame;
+			entry.ok = readFrame(frame_index, frame);
+			if (entry.ok) {
+				if (ROLLING_SHUTTER) {
+					entry.band_colors = sampleFrameBands(frame);
+					entry.colors = combineBandSections<SECTION_COUNT>(entry.band_colors, band_section_weights);
+				}
+				else {
+					entry.colors = sampleFrameSections(frame);
+				}
+				if (keep_sequential_frames) {
+					entry.frame = frame.clone();
+				}
+			}
+		}
+		return entry;
+	};
+	// drops every frame before frame_index
+	auto dropSequentialFrames = [&](int frame_index) {
+		while (sequential_base_frame < frame_index && !sequential_frames.empty()) {
+			sequential_frames.pop_front();
+			++sequential_base_frame;
+		}
+		sequential_base_frame = std::max(sequential_base_frame, frame_index);
+	};
+
+	// symbol i is shown from symbol_start_frame + i * symbol_period
+	int symbol_period = SYMBOL_FRAMES;
+	int symbol_start_frame = DECODE_START_FRAME - SYMBOL_FRAMES / 2;
+	if (SEQUENTIAL_DECODE && DETECT_SYMBOL_PERIOD) {
+		std::vector<std::array<cv::Vec3b, SECTION_COUNT>> detect_colors{};
+		for (int f = first_sequential_frame; f < first_sequential_frame + DETECT_FRAMES; ++f) {
+			detect_colors.push_back(sequentialFrame(f).colors);
+		}
+		const auto [period, phase] = detectSymbolPeriod<SECTION_COUNT>(detect_colors, MIN_SYMBOL_FRAMES, MAX_SYMBOL_FRAMES);
+		// symbol 0 is the one being shown at DECODE_START_FRAME
+		const int transition_frame = first_sequential_frame + phase;
+		symbol_period = period;
+		symbol_start_frame = transition_frame + ((DECODE_START_FRAME - transition_frame) / period) * period;
+		std::cout << "Symbol period: " << period << " frames, symbol 0 starts at frame " << symbol_start_frame << "\n";
+	}
+
+	// rolling shutter: how many frames later than symbol_start_frame each band's symbols start, from the
+	// transition phase of the band against that of the whole frame
+	std::array<int, ROW_BANDS> band_offsets{};
+	if (SEQUENTIAL_DECODE && ROLLING_SHUTTER) {
+		std::vector<std::array<cv::Vec3b, SECTION_COUNT>> detect_colors{};
+		std::array<std::vector<std::array<cv::Vec3b, SECTION_COUNT>>, ROW_BANDS> detect_band_colors{};
+		for (int f = first_sequential_frame; f < first_sequential_frame + DETECT_FRAMES; ++f) {
+			const auto& entry = sequentialFrame(f);
+			detect_colors.push_back(entry.colors);
+			for (int band = 0; band < ROW_BANDS; ++band) {
+				detect_band_colors[band].push_back(entry.band_colors[band]);
+			}
+		}
+		const int phase = detectSymbolPhase<SECTION_COUNT>(detect_colors, symbol_period);
+		for (int band = 0; band < ROW_BANDS; ++band) {
+			int offset = (detectSymbolPhase<SECTION_COUNT>(detect_band_colors[band], symbol_period) - phase + symbol_period) % symbol_period;
+			if (offset > symbol_period / 2) {
+				offset -= symbol_period;
+			}
+			band_offsets[band] = offset;
+			std::cout << "Row band " << band << " transitions " << offset << " frames after the frame's\n";
+		}
+	}
+	const int min_band_offset = *std::ranges::min_element(band_offsets);
+	keep_sequential_frames = debug_output.enabled();
+	const int first_symbol = resume_from ? resume_from->next_symbol : 0;
+	// the detection frames before the first symbol's window aren't needed again
+	dropSequentialFrames(symbol_start_frame + first_symbol * symbol_period + min_band_offset);
+
+	// The steadiest frame of the symbol window from start (see selectSymbolFrame) judged on one row band, or the
+	// whole frame when band < 0. Returns -1 if all the window's frames were dropped.
+	auto steadiestFrame = [&](int start, int band, std::array<cv::Vec3b, SECTION_COUNT>& colors) {
+		std::vector<std::array<cv::Vec3b, SECTION_COUNT>> window{};
+		std::vector<int> window_frames{};
+		for (int f = std::max(start, sequential_base_frame); f < start + symbol_period; ++f) {
+			const auto& entry = sequentialFrame(f);
+			if (entry.ok) {
+				window.push_back(band < 0 ? entry.colors : entry.band_colors[band]);
+				window_frames.push_back(f);
+			}
+		}
+		if (window.empty()) {
+			return -1;
+		}
+
+		const int best = selectSymbolFrame<SECTION_COUNT>(window, TRANSITION_FRAMES);
+		colors = window[best];
+		return window_frames[best];
+	};
+
+	// Decodes the section colours of symbol i from its best frame (with ROLLING_SHUTTER, each band from its own
+	// and frame_index is the middle band's), returns false if all its frames were dropped
+	auto readSequentialSymbol = [&](int symbol, int& frame_index, std::array<cv::Vec3b, SECTION_COUNT>& section_colors, cv::Mat& frame) {
+		const int window_start = symbol_start_frame + symbol * symbol_period;
+		int best_frame = -1;
+		if (ROLLING_SHUTTER) {
+			std::array<std::array<cv::Vec3b, SECTION_COUNT>, ROW_BANDS> band_colors{};
+			for (int band = 0; band < ROW_BANDS; ++band) {
+				const int band_frame = steadiestFrame(window_start + band_offsets[band], band, band_colors[band]);
+				if (band_frame < 0) {
+					return false;
+				}
+				if (band == ROW_BANDS / 2) {
+					best_frame = band_frame;
+				}
+			}
+			section_colors = combineBandSections<SECTION_COUNT>(band_colors, band_section_weights);
+		}
+		else {
+			best_frame = steadiestFrame(window_start, -1, section_colors);
+			if (best_frame < 0) {
+				return false;
+			}
+		}
+
+		frame_index = best_frame;
+		if (keep_sequential_frames) {
+			const auto& best_entry = sequentialFrame(frame_index);
+			frame = best_entry.frame.empty() ? cv::Mat(frame_size, CV_8UC3, cv::Scalar(0, 0, 0)) : best_entry.frame;
+		}
+		// no later symbol's window, in any band, goes back before the end of this one's earliest band
+		dropSequentialFrames(window_start + min_band_offset + symbol_period);
+		return true;
+	};
+
 	{
-		constexpr int START_FRAME = 2425;
-		constexpr int FRAMES = 246;
 		// each frame encodes three characters
 		cv::Mat frame;
-		for (int i = 0; i < FRAMES; ++i) {
-			cap.set(cv::CAP_PROP_POS_FRAMES, START_FRAME + (i * 24));
-			{
-				bool ret = cap.read(frame);
-				if (!ret) {
-					throw std::runtime_error("Failed to read frame");
+		for (int i = first_symbol; i < DECODE_FRAMES; ++i) {
+			int frame_index = DECODE_START_FRAME + (i * SYMBOL_FRAMES);
+			std::array<cv::Vec3b, SECTION_COUNT> section_colors{};
+			bool have_symbol{};
+			if (SEQUENTIAL_DECODE) {
+				have_symbol = readSequentialSymbol(i, frame_index, section_colors, frame);
+			}
+			else {
+				have_symbol = readFrame(frame_index, frame);
+				if (have_symbol) {
+					section_colors = sampleFrameSections(frame);
+				}
+			}
+			if (!have_symbol) {
+				// placeholder characters, flagged as failing parity in the chunk status
+				++lost_symbols;
+				int lost_chars = 3;
+				if (RATE_PLAN) {
+					// zero bits keep the alignment, every character the symbol was part of is lost
+					for (const auto& rate : rate_plan) {
+						plan_bits.push(0, -1, rate.bits, 0.0f);
+					}
+					int lost_errors = 0;
+					lost_chars = (int)plan_bits.take(lost_errors, corrected).size();
+				}
+				if (COMPRESSED_PAYLOAD) {
+					// keeps the bit alignment, the payload's crc will fail
+					std::string lost_chunk{};
+					for (int j = 0; j < lost_chars; ++j) {
+						lost_chunk += payload.push(0);
+					}
+					text_output.writeChunk(lost_chunk, lost_chars);
+					std::cout << lost_chunk << std::flush;
 				}
+				else {
+					const std::string lost_chunk(lost_chars, '?');
+					text_output.writeChunk(lost_chunk, lost_chars);
+					std::cout << lost_chunk << std::flush;
+				}
+				continue;
 			}
 
 			char c1{}, c2{}, c3{};
 			bool p1{}, p2{}, p3{};
 
-			for (int section_index = 0; section_index < 8; ++section_index) {
-				// find average colour
-				std::vector<cv::Vec3b> colors{};
-				for (const int box_index : sections[section_index]) {
-					pixelsInQuad(transformed_boxes[box_index], frame, [&](int x, int y) {
-						auto coords = lookupMaskCoordinate(x, y, H_inv);
-						//std::cout << "test\n";
-						if (mask.at<cv::Vec3b>(coords[1], coords[0])[1] == 255) {
-							colors.push_back(frame.at<cv::Vec3b>(y, x));
-						}
-						});
-				}
-				int best_index = lookupIndexFromColor(measured_colors_per_section[section_index], averageColor(colors));
+			std::array<int, SECTION_COUNT> levels{};
+			std::array<int, SECTION_COUNT> runner_up_levels{};
+			std::array<float, SECTION_COUNT> ambiguity{};
+			for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+				auto match = classifySection(section_index, section_colors[section_index]);
+				palette_trackers[section_index].update(match, section_colors[section_index]);
+				int best_index = match.index;
+				levels[section_index] = best_index;
+				runner_up_levels[section_index] = match.second_index;
+				ambiguity[section_index] = match.second_dist > 0 ? std::sqrt(match.dist / match.second_dist) : 1.0f;
 
 				if (section_index < 7) {
 					if (((best_index >> 0) & 1) == 1) {
@@ -513,30 +1531,108 @@ int main()
 					}
 				}
 			}
-			output_text.push_back(c1);
-			output_text.push_back(c2);
-			output_text.push_back(c3);
-			parities.push_back(p1);
-			parities.push_back(p2);
-			parities.push_back(p3);
-		}
-	}
 
-	std::string output_text_as_string{};
-	int i = 0;
-	int errors = 0;
-	for (const char c : output_text) {
-		output_text_as_string.push_back(c);
-		// check parity of char
-		if ((std::popcount(static_cast<unsigned char>(c)) & 1) != parities[i]) {
-			++errors;
+			std::string chars{};
+			int chunk_errors = 0;
+			if (RATE_PLAN) {
+				for (int section_index = 0; section_index < SECTION_COUNT; ++section_index) {
+					const auto& values = level_values[section_index];
+					const int runner_up = runner_up_levels[section_index];
+					plan_bits.push(values[levels[section_index]], runner_up >= 0 ? values[runner_up] : -1,
+						rate_plan[section_index].bits, ambiguity[section_index]);
+				}
+				chars = plan_bits.take(chunk_errors, corrected);
+			}
+			else {
+				// check parity of each char. Parity only detects an error, but if one section was much less
+				// certain than the rest it's the likely erasure, and flipping its bit corrects the char
+				// (when it's the parity section, the char itself is fine)
+				chars = { c1, c2, c3 };
+				const std::array<bool, 3> parities{ p1, p2, p3 };
+				const int erased_section = (int)(std::ranges::max_element(ambiguity) - ambiguity.begin());
+				for (int j = 0; j < 3; ++j) {
+					if ((std::popcount(static_cast<unsigned char>(chars[j])) & 1) != parities[j]) {
+						if (ERASURE_CORRECTION && ambiguity[erased_section] >= ERASURE_AMBIGUITY) {
+							if (erased_section < 7) {
+								chars[j] ^= (1 << erased_section);
+							}
+							++corrected;
+						}
+						else {
+							++chunk_errors;
+						}
+					}
+				}
+			}
+			errors += chunk_errors;
+
+			if (debug_output.enabled()) {
+				// frame with each box outlined in the calibrated colour of the level it was decoded as
+				debug_output.submit(std::format("frame{:06}", frame_index), [=, frame = frame.clone()] {
+					cv::Mat out = frame.clone();
+					for (int box_index = 0; box_index < BOX_COUNT; ++box_index) {
+						// cached frames are cropped, move the box into the crop
+						std::array<cv::Point2f, 4> box = transformed_boxes[box_index];
+						for (auto& corner : box) {
+							corner -= cv::Point2f(frame_origin);
+						}
+						const int section_index = BOX_SECTIONS[box_index];
+						cv::Scalar color = measured_colors_per_section[section_index][levels[section_index]];
+						cv::line(out, box[0], box[1], color, 3);
+						cv::line(out, box[1], box[3], color, 3);
+						cv::line(out, box[3], box[2], color, 3);
+						cv::line(out, box[2], box[0], color, 3);
+					}
+					return out;
+					});
+			}
+
+			std::string_view chunk = chars;
+			std::string payload_chunk{};
+			if (COMPRESSED_PAYLOAD) {
+				for (const char c : chars) {
+					payload_chunk += payload.push(c);
+				}
+				chunk = payload_chunk;
+			}
+			text_output.writeChunk(chunk, chunk_errors);
+			std::cout << chunk << std::flush;
+
+			if (stream) {
+				max_latency_frames = std::max(max_latency_frames, stream->latestFrameIndex() - frame_index);
+			}
+
+			if ((i + 1) % CHECKPOINT_SYMBOLS == 0) {
+				saveCheckpoint(checkpoint_path, { checkpoint_identity, i + 1, errors, corrected, lost_symbols, text_output.position(), measured_colors_per_section, box_weights, sample_level, palette_covariances });
+			}
 		}
-		++i;
 	}
 
-	std::cout << output_text_as_string << "\n";
+	// finished, so the next run starts from scratch
+	std::filesystem::remove(checkpoint_path);
+
+	std::cout << "\n";
 
 	std::cout << "Errors: " << errors << "\n";
+	if (ERASURE_CORRECTION) {
+		std::cout << "Corrected erasures: " << corrected << "\n";
+	}
+	if (RATE_PLAN && plan_bits.pendingBits() > 0) {
+		std::cout << "Trailing bits: " << plan_bits.pendingBits() << " (less than a character, not decoded)\n";
+	}
+	if (COMPRESSED_PAYLOAD) {
+		if (payload.valid()) {
+			std::cout << "Payload: " << payload.status() << "\n";
+		}
+		else {
+			std::cout << "Payload invalid: " << payload.status() << "\n";
+		}
+	}
+	if (stream) {
+		std::cout << "Lost symbols: " << lost_symbols << "\n";
+		std::cout << "Dropped frames: " << stream->droppedFrames() << "\n";
+		std::cout << "Max latency: " << max_latency_frames << " frames\n";
+	}
 
 	return 0;
 }
\ No newline at end of file